@@ -0,0 +1,278 @@
+/********************************************************************
+* Current.c - Module for sampling the PWM output currents
+* Sampling runs without the CPU. FTM3 puts out a trigger at the start
+* of every PWM period, which starts PDB0. PDB0 pre-trigger 0 of
+* channel 0 starts ADC0 after the delay set for PWM_CH0 and channel 1
+* starts ADC1 after the delay set for PWM_CH3. The PWM module sets
+* each delay to the middle of the channel's on-time, and scales the
+* PDB prescaler so a whole PWM period fits its counter. Each ADC
+* conversion raises a DMA request and eDMA moves the result into that
+* output's ring, wrapping with no interrupt. CurGetStats() reads the
+* latest samples out of a ring.
+********************************************************************/
+#include "MCUType.h"
+#include "app_cfg.h"
+#include "os.h"
+#include "PWM.h"
+#include "Current.h"
+
+#define CUR_PDB_TRG_FTM3    11U             //PDB TRGSEL for the FTM3 trigger
+#define CUR_DMA_SRC_ADC0    40U             //DMAMUX sources
+#define CUR_DMA_SRC_ADC1    41U
+#define CUR_DLY_MAX         0xFFFFUL        //PDB delay register limit
+#define CUR_PS_MAX          7U              //PDB prescaler, divide by 2^n
+
+//ADC CFG1: 12 bit, bus/4 = 15MHz ADCK to run, (bus/2)/8 = 3.75MHz
+//ADCK to calibrate, which must be done at 4MHz or less
+#define CUR_ADC_CFG1_RUN    (ADC_CFG1_ADIV(2) | ADC_CFG1_MODE(1) | ADC_CFG1_ADICLK(0))
+#define CUR_ADC_CFG1_CAL    (ADC_CFG1_ADIV(3) | ADC_CFG1_MODE(1) | ADC_CFG1_ADICLK(1))
+
+#if (CUR_RING_LEN & (CUR_RING_LEN - 1U)) != 0U
+#error "CUR_RING_LEN must be a power of 2"
+#endif
+
+/********************************************************************
+* Private Resources
+********************************************************************/
+static INT16U curRing0[CUR_RING_LEN];       //PWM_CH0 samples, DMA channel 0
+static INT16U curRing1[CUR_RING_LEN];       //PWM_CH3 samples, DMA channel 1
+static INT8U curDlyShift = 0;               //PDB prescaler, delays are bus clocks >> this
+
+static void curAdcCal(volatile INT32U *sc3, volatile INT32U *pg, volatile INT32U *clps);
+static INT16U curSqrt(INT32U x);
+
+/********************************************************************
+* CurInit() - Sets up ADC0/ADC1 for PDB triggered 12-bit conversions
+* with DMA requests, PDB0 triggered by FTM3, and DMA channels 0 and 1
+* as circular rings. Call after PWMInit().
+********************************************************************/
+void CurInit(void){
+
+    SIM_SCGC6 |= SIM_SCGC6_ADC0_MASK | SIM_SCGC6_PDB_MASK | SIM_SCGC6_DMAMUX_MASK;
+    SIM_SCGC3 |= SIM_SCGC3_ADC1_MASK;
+    SIM_SCGC7 |= SIM_SCGC7_DMA_MASK;
+
+    //ADCs: calibrated at the slow clock, then 15MHz ADCK, 12 bit,
+    //hardware (PDB) trigger, DMA on completion
+    ADC0_CFG1 = CUR_ADC_CFG1_CAL;
+    ADC1_CFG1 = CUR_ADC_CFG1_CAL;
+    curAdcCal(&ADC0_SC3, &ADC0_PG, &ADC0_CLPS);
+    curAdcCal(&ADC1_SC3, &ADC1_PG, &ADC1_CLPS);
+    ADC0_CFG1 = CUR_ADC_CFG1_RUN;
+    ADC1_CFG1 = CUR_ADC_CFG1_RUN;
+    ADC0_SC2 = ADC_SC2_ADTRG(1) | ADC_SC2_DMAEN(1);
+    ADC1_SC2 = ADC_SC2_ADTRG(1) | ADC_SC2_DMAEN(1);
+    ADC0_SC1A = ADC_SC1_ADCH(CUR_ADC0_INPUT);
+    ADC1_SC1A = ADC_SC1_ADCH(CUR_ADC1_INPUT);
+
+    //DMA: one 16-bit result per request, ring wraps at the end of the major loop
+    DMAMUX_CHCFG0 = 0;
+    DMAMUX_CHCFG1 = 0;
+    DMA_TCD0_SADDR = (INT32U)&ADC0_RA;
+    DMA_TCD0_SOFF = 0;
+    DMA_TCD0_ATTR = DMA_ATTR_SSIZE(1) | DMA_ATTR_DSIZE(1);
+    DMA_TCD0_NBYTES_MLNO = sizeof(INT16U);
+    DMA_TCD0_SLAST = 0;
+    DMA_TCD0_DADDR = (INT32U)&curRing0[0];
+    DMA_TCD0_DOFF = sizeof(INT16U);
+    DMA_TCD0_CITER_ELINKNO = DMA_CITER_ELINKNO_CITER(CUR_RING_LEN);
+    DMA_TCD0_BITER_ELINKNO = DMA_BITER_ELINKNO_BITER(CUR_RING_LEN);
+    DMA_TCD0_DLASTSGA = -(INT32S)sizeof(curRing0);
+    DMA_TCD0_CSR = 0;                       //No interrupts, stays enabled
+    DMA_TCD1_SADDR = (INT32U)&ADC1_RA;
+    DMA_TCD1_SOFF = 0;
+    DMA_TCD1_ATTR = DMA_ATTR_SSIZE(1) | DMA_ATTR_DSIZE(1);
+    DMA_TCD1_NBYTES_MLNO = sizeof(INT16U);
+    DMA_TCD1_SLAST = 0;
+    DMA_TCD1_DADDR = (INT32U)&curRing1[0];
+    DMA_TCD1_DOFF = sizeof(INT16U);
+    DMA_TCD1_CITER_ELINKNO = DMA_CITER_ELINKNO_CITER(CUR_RING_LEN);
+    DMA_TCD1_BITER_ELINKNO = DMA_BITER_ELINKNO_BITER(CUR_RING_LEN);
+    DMA_TCD1_DLASTSGA = -(INT32S)sizeof(curRing1);
+    DMA_TCD1_CSR = 0;
+    DMAMUX_CHCFG0 = DMAMUX_CHCFG_ENBL_MASK | DMAMUX_CHCFG_SOURCE(CUR_DMA_SRC_ADC0);
+    DMAMUX_CHCFG1 = DMAMUX_CHCFG_ENBL_MASK | DMAMUX_CHCFG_SOURCE(CUR_DMA_SRC_ADC1);
+    DMA_ERQ |= DMA_ERQ_ERQ0_MASK | DMA_ERQ_ERQ1_MASK;
+
+    //PDB: one-shot per FTM3 trigger, delays in bus clocks, loaded on the next trigger
+    PDB0_SC = PDB_SC_PDBEN_MASK | PDB_SC_TRGSEL(CUR_PDB_TRG_FTM3) | PDB_SC_LDMOD(2)
+              | PDB_SC_PRESCALER(curDlyShift);     //From CurSetPeriod() in PWMInit()
+    PDB0_MOD = PDB_MOD_MOD(CUR_DLY_MAX);
+    PDB0_IDLY = PDB_IDLY_IDLY(CUR_DLY_MAX);
+    PDB0_CH0DLY0 = PDB_DLY_DLY(0);
+    PDB0_CH1DLY0 = PDB_DLY_DLY(0);
+    PDB0_CH0C1 = PDB_C1_EN(1) | PDB_C1_TOS(1);     //Pre-trigger 0 -> ADC0 SC1A
+    PDB0_CH1C1 = PDB_C1_EN(1) | PDB_C1_TOS(1);     //Pre-trigger 0 -> ADC1 SC1A
+    PDB0_SC |= PDB_SC_LDOK_MASK;
+}
+
+/********************************************************************
+* CurSetPeriod() - Sets the PWM period, in bus clocks. Picks the
+* smallest PDB prescaler that keeps any point in the period within
+* the PDB delay registers. Up to 2^CUR_PS_MAX * 0xFFFF clocks, more
+* than the FTM3 16-bit counter can make. Called by the PWM module,
+* also before CurInit(). Safe to call from an ISR.
+********************************************************************/
+void CurSetPeriod(INT32U clks){
+    INT8U shift = 0;
+    CPU_SR_ALLOC();
+
+    while(((clks >> shift) > CUR_DLY_MAX) && (shift < CUR_PS_MAX)){
+        shift++;
+    }
+    CPU_CRITICAL_ENTER();
+    curDlyShift = shift;
+    if((SIM_SCGC6 & SIM_SCGC6_PDB_MASK) != 0){     //CurInit() has run
+        PDB0_SC = (PDB0_SC & ~PDB_SC_PRESCALER_MASK) | PDB_SC_PRESCALER(shift);
+    }else{
+    }
+    CPU_CRITICAL_EXIT();
+}
+
+/********************************************************************
+* CurSetSamplePoint() - Sets when in the PWM period a channel is
+* sampled, in bus clocks from the start of the period, rounded to the
+* PDB prescaler. Takes effect at the start of the next period, the
+* same time a buffered CnV loads. Called by the PWM module, ignored
+* before CurInit(). Safe to call from an ISR.
+********************************************************************/
+void CurSetSamplePoint(INT8U ch, INT32U clks){
+
+    if((SIM_SCGC6 & SIM_SCGC6_PDB_MASK) != 0){     //CurInit() has run
+        clks = (clks + ((1UL << curDlyShift) >> 1)) >> curDlyShift;
+        if(clks > CUR_DLY_MAX){                 //Only a point at the very end of the period
+            clks = CUR_DLY_MAX;
+        }else{
+        }
+        if(ch == PWM_CH0){
+            PDB0_CH0DLY0 = PDB_DLY_DLY(clks);
+        }else if(ch == PWM_CH3){
+            PDB0_CH1DLY0 = PDB_DLY_DLY(clks);
+        }else{
+        }
+        PDB0_SC |= PDB_SC_LDOK_MASK;
+    }else{
+    }
+}
+
+/********************************************************************
+* CurGetStats() - RMS, peak and average current of an output over its
+* last win samples (one per PWM period). win is limited to
+* CUR_WIN_MAX. Returns FALSE for an unknown channel or empty window.
+********************************************************************/
+INT8U CurGetStats(INT8U ch, INT16U win, CUR_STATS *stats){
+
+    const INT16U *ring;
+    INT16U end;
+    INT8U ok = TRUE;
+
+    if(win > CUR_WIN_MAX){
+        win = CUR_WIN_MAX;
+    }else{
+    }
+    if(ch == PWM_CH0){
+        ring = curRing0;
+        end = (INT16U)(CUR_RING_LEN - (DMA_TCD0_CITER_ELINKNO & DMA_CITER_ELINKNO_CITER_MASK));
+    }else if(ch == PWM_CH3){
+        ring = curRing1;
+        end = (INT16U)(CUR_RING_LEN - (DMA_TCD1_CITER_ELINKNO & DMA_CITER_ELINKNO_CITER_MASK));
+    }else{
+        ring = 0;
+        end = 0;
+        ok = FALSE;
+    }
+    if((ok == TRUE) && (win != 0)){
+        CurWindowStats(ring, CUR_RING_LEN, end, win, stats);
+    }else{
+        ok = FALSE;
+    }
+    return ok;
+}
+
+/********************************************************************
+* CurWindowStats() - RMS, peak and average of the win samples before
+* index end in a ring of len samples (len a power of 2). win is
+* limited to len and to CUR_WIN_MAX, which keeps the sum of squares of
+* 12-bit samples within 32 bits. An empty window reads as all 0.
+* Works on any ring, so recorded traces can be fed through it.
+********************************************************************/
+void CurWindowStats(const INT16U *ring, INT16U len, INT16U end, INT16U win, CUR_STATS *stats){
+
+    INT32U sum = 0;
+    INT32U sumSq = 0;
+    INT16U peak = 0;
+    INT16U i;
+    INT16U idx;
+    INT16U s;
+
+    if(win > len){
+        win = len;
+    }else{
+    }
+    if(win > CUR_WIN_MAX){
+        win = CUR_WIN_MAX;
+    }else{
+    }
+    idx = (INT16U)(end - win) & (len - 1U);
+    for(i = 0; i < win; i++){
+        s = ring[idx];
+        sum += s;
+        sumSq += (INT32U)s * s;
+        if(s > peak){
+            peak = s;
+        }else{
+        }
+        idx = (idx + 1U) & (len - 1U);
+    }
+    stats->peak = peak;
+    if(win != 0){
+        stats->avg = (INT16U)(sum / win);
+        stats->rms = curSqrt(sumSq / win);
+    }else{
+        stats->avg = 0;
+        stats->rms = 0;
+    }
+}
+
+/********************************************************************
+* curAdcCal() - Runs the ADC self calibration and loads the plus-side
+* gain. Blocks for the calibration time. The ADC is left in software
+* trigger mode.
+********************************************************************/
+static void curAdcCal(volatile INT32U *sc3, volatile INT32U *pg, volatile INT32U *clps){
+
+    INT32U sum;
+
+    *sc3 = ADC_SC3_AVGE(1) | ADC_SC3_AVGS(3) | ADC_SC3_CAL(1);
+    while((*sc3 & ADC_SC3_CAL_MASK) != 0){}
+    if((*sc3 & ADC_SC3_CALF_MASK) == 0){
+        //CLPS, CLP4, CLP3, CLP2, CLP1 and CLP0 are consecutive words
+        sum = clps[0] + clps[1] + clps[2] + clps[3] + clps[4] + clps[5];
+        *pg = (sum >> 1) | 0x8000UL;
+    }else{ //Calibration failed, keep the reset gain
+    }
+    *sc3 = 0;                               //No averaging, one sample per trigger
+}
+
+/********************************************************************
+* curSqrt() - Integer square root, rounded down.
+********************************************************************/
+static INT16U curSqrt(INT32U x){
+
+    INT32U root = 0;
+    INT32U bit = 1UL << 30;
+
+    while(bit > x){
+        bit >>= 2;
+    }
+    while(bit != 0){
+        if(x >= root + bit){
+            x -= root + bit;
+            root = (root >> 1) + bit;
+        }else{
+            root >>= 1;
+        }
+        bit >>= 2;
+    }
+    return (INT16U)root;
+}
@@ -0,0 +1,35 @@
+/********************************************************************
+* Current.h - Header file for the current sampling module
+********************************************************************/
+#ifndef CURRENT_H_
+#define CURRENT_H_
+
+//ADC inputs sensing the current of PWM_CH0 (ADC0) and PWM_CH3 (ADC1)
+#define CUR_ADC0_INPUT 0U       //ADC0_DP0
+#define CUR_ADC1_INPUT 0U       //ADC1_DP0
+
+//Samples kept per output, one per PWM period. Power of 2.
+#define CUR_RING_LEN 256U
+
+//Longest window CurGetStats() and CurWindowStats() accept. Leaves the DMA half
+//a ring to write into while a window is read.
+#define CUR_WIN_MAX (CUR_RING_LEN / 2U)
+
+//Sense scaling, uA per ADC count (12 bit)
+#define CUR_UA_PER_LSB 1000UL
+#define CUR_COUNTS_TO_MA(c) ((INT32U)(((INT32U)(c) * CUR_UA_PER_LSB) / 1000UL))
+
+//Windowed current of one output, ADC counts
+typedef struct{
+    INT16U rms;
+    INT16U peak;
+    INT16U avg;
+}CUR_STATS;
+
+void CurInit(void);
+void CurSetPeriod(INT32U clks);
+void CurSetSamplePoint(INT8U ch, INT32U clks);
+INT8U CurGetStats(INT8U ch, INT16U win, CUR_STATS *stats);
+void CurWindowStats(const INT16U *ring, INT16U len, INT16U end, INT16U win, CUR_STATS *stats);
+
+#endif
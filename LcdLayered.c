@@ -14,6 +14,23 @@
 *                
 *                Cursor code is derived from Keegan Morrow, 02/22/2013  
 *                                                                        
+*                The bus is driven by PIT2. lcdWrite() only queues a
+*                command or character, and PIT2_IRQHandler clocks the
+*                queue out one E edge per interrupt, waiting out each
+*                instruction's execution time with the timer. The CPU
+*                is free between strobes.
+*                With LCD_BUSY_POLL set, the engine reads the busy flag
+*                after each write and moves on as soon as it clears,
+*                falling back to the worst-case time if it never does.
+*                                                                        
+*                Each layer keeps a bitmap of the cells written since the
+*                last repaint, and only those cells are composited,
+*                four cells per 32-bit word.
+*                                                                        
+*                The driver shadows the LCD address counter and display
+*                control register, so address and cursor commands are
+*                only sent when they would change something.
+*                                                                        
 * Todd Morton, 02/26/2013, First Revised Release
 * 01/22/2015, Added to git repo, general clean up. TDM
 * 02/03/2016, More cleanup. TDM
@@ -43,6 +60,24 @@
 #define LCD_SET_E()    GPIOD_PSOR = LCD_E_BIT
 #define LCD_CLR_E()    GPIOD_PCOR = LCD_E_BIT
 #define LCD_WR_DB(nib) (GPIOD_PDOR = (GPIOD_PDOR & ~LCD_DB_MASK)|((nib)<<3))
+#if LCD_BUSY_POLL != 0U
+#define LCD_RW_BIT     0x1
+#define LCD_BF_BIT     0x40                 //DB7 on PTD6
+#define LCD_SET_RW()   GPIOD_PSOR = LCD_RW_BIT
+#define LCD_CLR_RW()   GPIOD_PCOR = LCD_RW_BIT
+#define LCD_DB_IN()    (LCD_PORT_DIR &= ~LCD_DB_MASK)
+#define LCD_DB_OUT()   (LCD_PORT_DIR |= LCD_DB_MASK)
+#endif
+
+/*****************************************************************************************
+* LCD Bus Engine Defines
+*****************************************************************************************/
+#define LCD_BUS_CLK     60000000UL          //PIT clock (bus clock), Hz
+#define LCD_CLK_PER_US  (LCD_BUS_CLK / 1000000UL)
+#define LCD_E_US        1UL                 //E high time, and E low time between nibbles
+#define LCD_EXEC_US     41UL                //Execution time of most instructions
+#define LCD_CLR_US      1650UL              //Execution time of clear display and return home
+#define LCD_BUS_Q_LEN   64U                 //Queued writes, power of two. A full repaint is 36.
 
 
 /*****************************************************************************************
@@ -54,6 +89,11 @@
 
 #define LCD_ENABLE     0x04
 #define LCD_CLEAR_BYTE 0x20    //SPACE is set as the transparent character
+#define LCD_ALL_CELLS  0xFFFFFFFFUL    //Dirty bitmap, bit row*LCD_NUM_COLS+col
+#define LCD_ROW_CELLS  0x0000FFFFUL
+#define LCD_WORD_CELLS 0x0000000FUL    //Dirty bits of one composited word
+#define LCD_CLEAR_WORD 0x20202020UL    //LCD_CLEAR_BYTE in each byte
+#define LCD_AC_UNKNOWN 0xFF            //lcdAddr after the address counter is lost
 
 // LCD Cursor typedef
 typedef struct {
@@ -63,11 +103,34 @@ typedef struct {
     INT8U blink;
 }LCD_CURSOR;
 
+// Bus engine phases, one per PIT2 interrupt
+typedef enum{LCD_PH_HI,LCD_PH_HI_LATCH,LCD_PH_LO,LCD_PH_LO_LATCH,
+             LCD_PH_BF_HI,LCD_PH_BF_LATCH,LCD_PH_BF_LO,LCD_PH_BF_LO_LATCH} LCD_PHASE;
+
+// Bus engine queue. lcdWrite() fills it and PIT2_IRQHandler() empties it.
+typedef struct {
+    INT16U ring[LCD_BUS_Q_LEN];
+    volatile INT8U head;        // Next free slot
+    volatile INT8U tail;        // Write being clocked out
+    LCD_PHASE phase;
+    volatile INT8U run;         // PIT2 running
+    volatile INT8U wait;        // A writer is pending on room
+#if LCD_BUSY_POLL != 0U
+    INT16U polls;               // Busy flag reads left before the fallback
+    INT8U busy;                 // Busy flag from the last read
+    INT32U timeouts;            // Busy flag never cleared, fell back to the fixed time
+#endif
+    OS_SEM room;                // Posted when the queue drains for a waiting writer
+}LCD_BUS;
+
 // LCD layer and buffer typdedef
+// lcd_char is kept first and LCD_NUM_COLS a multiple of 4 so the compositor
+// can read and write it as 32-bit words.
 typedef struct {
     INT8C lcd_char[LCD_NUM_ROWS][LCD_NUM_COLS];
     INT8U hidden;
     LCD_CURSOR cursor;
+    INT32U dirty;               // Cells changed since the last repaint
 } LCD_BUFFER;
 
 /*************************************************************************
@@ -77,11 +140,17 @@ static void lcdDlyus(INT16U us);
 static void lcdDly500ns(void);
 static void lcdWrite(INT16U data);
 static void lcdClear(LCD_BUFFER *buffer);
+static void lcdDirtyCells(LCD_BUFFER *layer, INT8U row_index, INT8U col_index, INT8U n);
+static INT32U lcdOpaqueMask(INT32U chars);
 
 static void lcdFlattenLayers(LCD_BUFFER *dest_buffer,
                              LCD_BUFFER *src_layers);
 static void lcdWriteBuffer(LCD_BUFFER *buffer);
 static void lcdMoveCursor(INT8U row, INT8U col);
+static void lcdSetAddr(INT8U addr);
+static void lcdBusInit(void);
+static void lcdBusNext(INT32U us);
+void PIT2_IRQHandler(void);
 
 /*************************************************************************
   MicroC/OS Resources
@@ -101,6 +170,10 @@ static const INT8U lcdRowAddress[LCD_NUM_ROWS] = {0x00, 0x40};
 static LCD_BUFFER lcdBuffer;
 static LCD_BUFFER lcdPreviousBuffer;
 static LCD_BUFFER lcdLayers[LCD_NUM_LAYERS];
+static LCD_BUS lcdBus;
+static INT8U lcdAddr = LCD_AC_UNKNOWN;      // Shadow of the LCD address counter
+static INT16U lcdCtrl = 0;                  // Shadow of the last LCD_ON_OFF() sent
+static LCD_STATS lcdStats;
 
 /*************************************************************************
   LCD Command Macros
@@ -144,9 +217,9 @@ static LCD_BUFFER lcdLayers[LCD_NUM_LAYERS];
 /******************************************************************************
   lcdLayeredTask() - Handles writing to the LCD module      (Private Task)
   
-        When writing to the LCD, will block until thescreen is updated.  
-        This is worst-case x.xms, but will be much lower if not every character 
-        on the screen is changing.
+        Flattens the layers and queues the changed characters for the bus
+        engine. It does not wait for them to reach the LCD, and only blocks
+        if the bus queue is full.
 ******************************************************************************/
 static void lcdLayeredTask(void *p_arg) {
     OS_ERR os_err;
@@ -163,6 +236,7 @@ static void lcdLayeredTask(void *p_arg) {
         
         lcdFlattenLayers(&lcdBuffer, (LCD_BUFFER *)&lcdLayers);
         lcdWriteBuffer(&lcdBuffer);
+        lcdStats.repaints++;
     }
 }
 
@@ -219,6 +293,7 @@ void LcdDispClear(INT8U layer) {
     }
 
     lcdClear(llayer);
+    llayer->dirty = LCD_ALL_CELLS;
 
     (void)OSMutexPost(&lcdLayersKey, OS_OPT_POST_NONE, &os_err);
     while(os_err != OS_ERR_NONE){           /* Error Trap                        */
@@ -251,6 +326,7 @@ void LcdDispClrLine(INT8U row, INT8U layer) {
         // Clear the character at that position
         llayer->lcd_char[row-1][col] = LCD_CLEAR_BYTE;
     }
+    llayer->dirty |= LCD_ROW_CELLS << ((row-1) * LCD_NUM_COLS);
     
     (void)OSMutexPost(&lcdLayersKey, OS_OPT_POST_NONE, &os_err);
     while(os_err != OS_ERR_NONE){           /* Error Trap                        */
@@ -292,6 +368,11 @@ void LcdDispString(INT8U row,
         }else{ //outside buffer
         }
     }
+    if(col_index < LCD_NUM_COLS){
+        lcdDirtyCells(llayer, row_index, col_index,
+                      (cnt < (LCD_NUM_COLS - col_index)) ? cnt : (LCD_NUM_COLS - col_index));
+    }else{
+    }
     
     (void)OSMutexPost(&lcdLayersKey, OS_OPT_POST_NONE, &os_err);
     while(os_err != OS_ERR_NONE){           /* Error Trap                        */
@@ -327,6 +408,7 @@ void LcdDispChar(INT8U row,
     
         // Copy from the passed paramater to the layer
         llayer->lcd_char[row_index][col_index] = character;
+        lcdDirtyCells(llayer, row_index, col_index, 1);
     
         (void)OSMutexPost(&lcdLayersKey, OS_OPT_POST_NONE, &os_err);
         while(os_err != OS_ERR_NONE){           /* Error Trap                        */
@@ -371,7 +453,7 @@ void LcdDispByte(INT8U row, INT8U col, INT8U layer, INT8U byte) {
         // Convert LSB to ASCII character
         llayer->lcd_char[row_index][col_index+1] +=
             (llayer->lcd_char[row_index][col_index+1] <= 9 ? '0' : 'A' - 10);
-
+        lcdDirtyCells(llayer, row_index, col_index, 2);
 
         (void)OSMutexPost(&lcdLayersKey, OS_OPT_POST_NONE, &os_err);
         while(os_err != OS_ERR_NONE){           /* Error Trap                        */
@@ -428,6 +510,7 @@ void LcdDispDecByte(INT8U row,
     
         llayer->lcd_char[row_index][col_index+2] = ones;      // Ones
         llayer->lcd_char[row_index][col_index+2] += '0';      //  --> ASCII
+        lcdDirtyCells(llayer, row_index, col_index, 3);
         
 
         (void)OSMutexPost(&lcdLayersKey, OS_OPT_POST_NONE, &os_err);
@@ -481,6 +564,7 @@ void LcdDispTime(INT8U row,
 
         llayer->lcd_char[row_index][col_index+6] = secs / 10 + '0';
         llayer->lcd_char[row_index][col_index+7] = secs % 10 + '0';
+        lcdDirtyCells(llayer, row_index, col_index, 8);
     
            
         (void)OSMutexPost(&lcdLayersKey, OS_OPT_POST_NONE, &os_err);
@@ -535,6 +619,11 @@ void LcdInit(void) {
     PORTD_PCR5=(0|PORT_PCR_MUX(1));
     PORTD_PCR6=(0|PORT_PCR_MUX(1));
     INIT_BIT_DIR();
+#if LCD_BUSY_POLL != 0U
+    PORTD_PCR0=(0|PORT_PCR_MUX(1));
+    LCD_CLR_RW();           /* Write until the engine reads the busy flag */
+    LCD_PORT_DIR |= LCD_RW_BIT;
+#endif
     LCD_CLR_E(); 
     LCD_SET_RS();           /*Data select unless in LcdWrCmd()  */
     lcdDlyus(15000);           /* LCD requires 15ms delay at powerup */
@@ -564,17 +653,20 @@ void LcdInit(void) {
     LCD_CLR_E();
     lcdDlyus(41);
   
+    lcdBusInit();                   /* Bus engine times the rest */
     lcdWrite(LCD_FUNCTION(0, 1, 0));     /*Send command for 4-bit mode */
     lcdWrite(LCD_ENTRY_MODE(1, 0)); // Increment, no shift
     lcdWrite(LCD_ON_OFF(1, 0, 0));  // LCD on, cursor off, blink off
     lcdWrite(LCD_CLR_DISP());       // Clear display
-    lcdDlyus(1650);
     lcdWrite(LCD_DD_RAM(0x0000));   // Reset cursor
+    lcdAddr = 0x00;
+    lcdCtrl = LCD_ON_OFF(1, 0, 0);
     
     
     // Clear all of our layers
     for(layer_cnt = 0; layer_cnt < LCD_NUM_LAYERS; layer_cnt++) {
         lcdClear(&lcdLayers[layer_cnt]);
+        lcdLayers[layer_cnt].dirty = 0;     // Matches the cleared lcdBuffer
     }
     
     // Clear the current buffer
@@ -590,16 +682,20 @@ void LcdInit(void) {
         The src_layer with the lowest index will be on the bottom, the
         src_layer with the highest index will be on the top.  Treats the
         character defined as LCD_CLEAR_BYTE as a transparent byte.
+        Only the words of four cells with a cell dirty in some layer are
+        recomputed. Each goes top layer down, taking the cells that are
+        not transparent and not already taken, and stops once all four
+        are taken. The rest of *dest_buffer is kept from the last call.
 
                        Pends on the lcdLayersKey mutex
 *************************************************************************/
 static void lcdFlattenLayers(LCD_BUFFER *dest_buffer,
                              LCD_BUFFER *src_layers) {
     
-    INT8U layer, row, col, current_char;
+    INT8U layer, word;
+    INT32U dirty = 0;
+    INT32U chars, take, out, done;
     OS_ERR os_err;
-    // Clear the destination buffer
-    lcdClear(dest_buffer);
 
 //    DBUG_PORT &= ~DBUG_LCDTASK;
     OSMutexPend(&lcdLayersKey, 0, OS_OPT_PEND_BLOCKING, (CPU_TS *)0, &os_err);
@@ -610,39 +706,39 @@ static void lcdFlattenLayers(LCD_BUFFER *dest_buffer,
     dest_buffer->cursor.on = FALSE;
     dest_buffer->cursor.blink = FALSE;
 
-    // For each layer...
+    // Collect the dirty cells, and the cursor of the top shown layer
     for(layer = 0; layer < LCD_NUM_LAYERS; layer++) {
-
-        // If that layer is not hidden...
+        dirty |= (src_layers+layer)->dirty;
+        (src_layers+layer)->dirty = 0;
         if((src_layers+layer)->hidden == 0) {
-            // For each row...
-            for(row = 0; row < LCD_NUM_ROWS; row++) {
-                // For each column...
-                for(col = 0; col < LCD_NUM_COLS; col++) {
-                    current_char = (src_layers+layer)->lcd_char[row][col];
-                
-                    // If the source layer is not null
-                    if(current_char != LCD_CLEAR_BYTE) {
-                        // Copy from the source layer to the buffer
-                        dest_buffer->lcd_char[row][col] = current_char;
-                    }else{ //Do nothing - transparent
-                    }
-                    
-                } // column
-            } // row
-
-            //Handle the cursor status
-//            if ( (src_layers+layer)->cursor.on != FALSE){
-                dest_buffer->cursor.col = (src_layers+layer)->cursor.col;
-                dest_buffer->cursor.row = (src_layers+layer)->cursor.row;
-                dest_buffer->cursor.on = (src_layers+layer)->cursor.on;
-                dest_buffer->cursor.blink = (src_layers+layer)->cursor.blink;
-//            }else{
-                // This layer doesn't move the cursor, do nothing
-//            }
+            dest_buffer->cursor.col = (src_layers+layer)->cursor.col;
+            dest_buffer->cursor.row = (src_layers+layer)->cursor.row;
+            dest_buffer->cursor.on = (src_layers+layer)->cursor.on;
+            dest_buffer->cursor.blink = (src_layers+layer)->cursor.blink;
         }else{ //Do nothing - layer is hidden
         }
-    } // layer
+    }
+
+    // For each word with a dirty cell...
+    while(dirty != 0) {
+        word = (INT8U)((31U - __CLZ(dirty)) >> 2);
+        dirty &= ~(LCD_WORD_CELLS << (word * 4U));
+        out = 0;
+        done = 0;
+        layer = LCD_NUM_LAYERS;
+        // Top down until every cell is taken
+        while((layer > 0) && (done != 0xFFFFFFFFUL)) {
+            layer--;
+            if((src_layers+layer)->hidden == 0) {
+                chars = ((INT32U *)(src_layers+layer)->lcd_char)[word];
+                take = lcdOpaqueMask(chars) & ~done;
+                out |= chars & take;
+                done |= take;
+            }else{ //Do nothing - layer is hidden
+            }
+        }
+        ((INT32U *)dest_buffer->lcd_char)[word] = out | (LCD_CLEAR_WORD & ~done);
+    }
     
     (void)OSMutexPost(&lcdLayersKey, OS_OPT_POST_NONE, &os_err);
     while(os_err != OS_ERR_NONE){           /* Error Trap                        */
@@ -656,20 +752,19 @@ static void lcdFlattenLayers(LCD_BUFFER *dest_buffer,
   
         The previous buffer lcdPreviousBuffer is a global variable
         containing a copy of the actual contents of the LCD module.  By 
-        using the lcdPreviousBuffer and repos_flag, we are able to only
-        write bytes that have changed.
+        using the lcdPreviousBuffer, we are able to only write bytes
+        that have changed. lcdSetAddr() only moves the address counter
+        when a changed byte is not where it already points, so an
+        unchanged row or a run of changed bytes costs no address
+        commands. The cursor is only placed when it is shown.
                                                            
-                     Blocks for as long as lcdWrite() blocks
+                     Only blocks if lcdWrite() finds the bus queue full
 *************************************************************************/
 static void lcdWriteBuffer(LCD_BUFFER *buffer) {
-    INT8U row, col, repos_flag;
+    INT8U row, col;
     
     // For each row...
     for(row = 0; row < LCD_NUM_ROWS; row++) {
-    
-        // Set our cursor to the beginning of the row
-        lcdWrite(LCD_DD_RAM(lcdRowAddress[row]));
-        repos_flag = 0;
         
         // For each column...
         for(col = 0; col < LCD_NUM_COLS; col++) {
@@ -678,63 +773,221 @@ static void lcdWriteBuffer(LCD_BUFFER *buffer) {
             if(lcdPreviousBuffer.lcd_char[row][col]
                 != buffer->lcd_char[row][col]) {
                 
-                // If we need to reposition, do that now
-                if(repos_flag == 1) {
-                    lcdWrite(LCD_DD_RAM((lcdRowAddress[row] + col)));
-                    repos_flag = 0;
-                }
+                // Reposition if the address counter is elsewhere
+                lcdSetAddr(lcdRowAddress[row] + col);
             
-                // Write the character to the LCD
+                // Write the character to the LCD, it moves the address counter on
                 lcdWrite(LCD_WRITE(buffer->lcd_char[row][col]));
+                lcdAddr++;
              
                 // And update the previous buffer
                 lcdPreviousBuffer.lcd_char[row][col] =
                     buffer->lcd_char[row][col];
             } else {
-                // Otherwise we don't write the character... but we need
-                //   to set the reposition flag
-                
-                repos_flag = 1;
+                // Otherwise we don't write the character
             }
-            
-        
         }
     }
     // At the end setup the cursor
-    lcdMoveCursor(buffer->cursor.row,buffer->cursor.col);
+    if((buffer->cursor.on != FALSE) || (buffer->cursor.blink != FALSE)){
+        lcdMoveCursor(buffer->cursor.row,buffer->cursor.col);
+    }else{ // Not shown, leave the address counter where it is
+    }
     LcdCursorDispMode(buffer->cursor.on, buffer->cursor.blink);
 
 }
 
 /******************************************************************************
-  lcdWrite() - Writes a command (both data and control busses)   (Private)
-               to the LCD.
+  lcdWrite() - Queues a command or character for the LCD        (Private)
                data is a 16-bit value bits 9-15 are not used, bit 8 is the 
                register select, bits 0-7 is the character or command.
-               
+               Starts the bus engine if it is idle. If the queue is full,
+               pends until the engine drains it.
 ******************************************************************************/
 static void lcdWrite(INT16U data) {
-    INT8U c;
-    // Set/Reset RS
+    OS_ERR os_err;
+    INT8U full;
+    CPU_SR_ALLOC();
+
+    do{
+        CPU_CRITICAL_ENTER();
+        full = (INT8U)((INT8U)(lcdBus.head - lcdBus.tail) >= LCD_BUS_Q_LEN);
+        if(full == FALSE){
+            lcdBus.ring[lcdBus.head & (LCD_BUS_Q_LEN - 1U)] = data;
+            lcdBus.head++;
+            if(lcdBus.run == FALSE){
+                lcdBus.run = TRUE;
+                lcdBus.phase = LCD_PH_HI;
+                lcdBusNext(LCD_E_US);
+            }else{
+            }
+        }else{
+            lcdBus.wait = TRUE;             // Engine is running, it will post
+        }
+        CPU_CRITICAL_EXIT();
+        if(full == TRUE){
+            (void)OSSemPend(&(lcdBus.room), 0, OS_OPT_PEND_BLOCKING, (CPU_TS *)0, &os_err);
+            while(os_err != OS_ERR_NONE){           /* Error Trap                        */
+            }
+        }else{
+        }
+    }while(full == TRUE);
     if((data & 0x0100) == 0x0100){
-        LCD_SET_RS(); //data write
+        lcdStats.chars++;
     }else{
-        LCD_CLR_RS(); //command write
+        lcdStats.cmds++;
     }
-    
-    c = (INT8U)data;
-    // Write character/command to LCD
-    LCD_WR_DB((c>>4));
-    LCD_SET_E();
-    lcdDly500ns();
-    LCD_CLR_E();
-    lcdDly500ns();
-    lcdDly500ns();
-    LCD_WR_DB((c&0x0f));
-    LCD_SET_E();
-    lcdDly500ns();
-    LCD_CLR_E();
-    lcdDlyus(41);
+}
+
+/******************************************************************************
+  lcdBusInit() - Sets up PIT2 for the bus engine, stopped.      (Private)
+******************************************************************************/
+static void lcdBusInit(void) {
+    OS_ERR os_err;
+
+    OSSemCreate(&(lcdBus.room), "LCD Bus Room", 0, &os_err);
+    while(os_err != OS_ERR_NONE){           /* Error Trap                        */
+    }
+    lcdBus.head = 0;
+    lcdBus.tail = 0;
+    lcdBus.run = FALSE;
+    lcdBus.wait = FALSE;
+
+    SIM_SCGC6 |= SIM_SCGC6_PIT(1);
+    PIT_MCR = PIT_MCR_FRZ(1);                   //Module on, stops in debug
+    PIT_TCTRL2 = 0;
+    PIT_TFLG2 = PIT_TFLG_TIF_MASK;
+    NVIC_ClearPendingIRQ(PIT2_IRQn);
+    NVIC_EnableIRQ(PIT2_IRQn);
+}
+
+/******************************************************************************
+  lcdBusNext() - Restarts PIT2 to interrupt after us microseconds. (Private)
+                 Restarting, rather than reloading, makes the interval
+                 start now. Interrupt latency only lengthens it.
+******************************************************************************/
+static void lcdBusNext(INT32U us) {
+    PIT_TCTRL2 = 0;
+    PIT_LDVAL2 = (us * LCD_CLK_PER_US) - 1UL;
+    PIT_TCTRL2 = PIT_TCTRL_TIE(1) | PIT_TCTRL_TEN(1);
+}
+
+/******************************************************************************
+  PIT2_IRQHandler() - Bus engine. Each interrupt makes one E edge of the
+                      write at the queue tail: high nibble up, latch, low
+                      nibble up, latch. After the low nibble it waits the
+                      instruction's execution time, then starts the next
+                      write or stops when the queue is empty.
+                      With LCD_BUSY_POLL set, it reads the busy flag
+                      instead, two E pulses per read, until the flag
+                      clears or the execution time has passed in reads.
+******************************************************************************/
+void PIT2_IRQHandler(void) {
+    OS_ERR os_err;
+    INT16U data;
+    CPU_SR_ALLOC();
+
+    CPU_CRITICAL_ENTER();
+    OSIntEnter();
+    CPU_CRITICAL_EXIT();
+
+    PIT_TFLG2 = PIT_TFLG_TIF_MASK;
+    data = lcdBus.ring[lcdBus.tail & (LCD_BUS_Q_LEN - 1U)];
+    switch(lcdBus.phase){
+    case LCD_PH_HI:
+        if(lcdBus.tail == lcdBus.head){     // Drained
+            PIT_TCTRL2 = 0;
+            lcdBus.run = FALSE;
+            if(lcdBus.wait == TRUE){
+                lcdBus.wait = FALSE;
+                (void)OSSemPost(&(lcdBus.room), OS_OPT_POST_1, &os_err);
+            }else{
+            }
+        }else{
+            if((data & 0x0100) == 0x0100){
+                LCD_SET_RS(); //data write
+            }else{
+                LCD_CLR_RS(); //command write
+            }
+            LCD_WR_DB(((INT8U)data)>>4);
+            LCD_SET_E();
+            lcdBus.phase = LCD_PH_HI_LATCH;
+            lcdBusNext(LCD_E_US);
+        }
+        break;
+    case LCD_PH_HI_LATCH:
+        LCD_CLR_E();
+        lcdBus.phase = LCD_PH_LO;
+        lcdBusNext(LCD_E_US);
+        break;
+    case LCD_PH_LO:
+        LCD_WR_DB(((INT8U)data)&0x0f);
+        LCD_SET_E();
+        lcdBus.phase = LCD_PH_LO_LATCH;
+        lcdBusNext(LCD_E_US);
+        break;
+#if LCD_BUSY_POLL != 0U
+    case LCD_PH_LO_LATCH:
+        LCD_CLR_E();
+        lcdBus.tail++;
+        if(((data & 0x01FC) == 0) && ((data & 0x0003) != 0)){  // Clear display or return home
+            lcdBus.polls = (INT16U)((LCD_CLR_US / (4UL * LCD_E_US)) + 1UL);
+        }else{
+            lcdBus.polls = (INT16U)((LCD_EXEC_US / (4UL * LCD_E_US)) + 1UL);
+        }
+        LCD_DB_IN();
+        LCD_CLR_RS();
+        LCD_SET_RW();
+        lcdBus.phase = LCD_PH_BF_HI;
+        lcdBusNext(LCD_E_US);
+        break;
+    case LCD_PH_BF_HI:
+        LCD_SET_E();
+        lcdBus.phase = LCD_PH_BF_LATCH;
+        lcdBusNext(LCD_E_US);
+        break;
+    case LCD_PH_BF_LATCH:
+        lcdBus.busy = (INT8U)((GPIOD_PDIR & LCD_BF_BIT) != 0);
+        LCD_CLR_E();
+        lcdBus.phase = LCD_PH_BF_LO;
+        lcdBusNext(LCD_E_US);
+        break;
+    case LCD_PH_BF_LO:
+        LCD_SET_E();                        // Low nibble of the read, not used
+        lcdBus.phase = LCD_PH_BF_LO_LATCH;
+        lcdBusNext(LCD_E_US);
+        break;
+    default:                                // LCD_PH_BF_LO_LATCH
+        LCD_CLR_E();
+        lcdBus.polls--;
+        if((lcdBus.busy != FALSE) && (lcdBus.polls != 0)){
+            lcdBus.phase = LCD_PH_BF_HI;    // Read again
+        }else{
+            if(lcdBus.busy != FALSE){
+                lcdBus.timeouts++;
+            }else{
+            }
+            LCD_CLR_RW();
+            LCD_DB_OUT();
+            lcdBus.phase = LCD_PH_HI;
+        }
+        lcdBusNext(LCD_E_US);
+        break;
+#else
+    default:                                // LCD_PH_LO_LATCH
+        LCD_CLR_E();
+        lcdBus.tail++;
+        lcdBus.phase = LCD_PH_HI;
+        if(((data & 0x01FC) == 0) && ((data & 0x0003) != 0)){  // Clear display or return home
+            lcdBusNext(LCD_CLR_US);
+        }else{
+            lcdBusNext(LCD_EXEC_US);
+        }
+        break;
+#endif
+    }
+
+    OSIntExit();
 }
 
 
@@ -757,6 +1010,32 @@ static void lcdClear(LCD_BUFFER *buffer) {
     
 }
 
+/*************************************************************************
+  lcdDirtyCells() - Marks n cells of a layer from [row_index,col_index]
+                    for the next repaint. n must not run past the row.
+                    Call with the lcdLayersKey mutex held.     (Private)
+*************************************************************************/
+static void lcdDirtyCells(LCD_BUFFER *layer, INT8U row_index, INT8U col_index, INT8U n) {
+    layer->dirty |= (((INT32U)1 << n) - 1UL) << ((row_index * LCD_NUM_COLS) + col_index);
+}
+
+/*************************************************************************
+  lcdOpaqueMask() - Returns 0xFF in each byte of chars that is not
+                    LCD_CLEAR_BYTE, 0x00 in each that is.      (Private)
+                    Uses the M4 SIMD instructions when the compiler has
+                    them, otherwise the portable carry trick.
+*************************************************************************/
+static INT32U lcdOpaqueMask(INT32U chars) {
+    INT32U x = chars ^ LCD_CLEAR_WORD;      // Zero bytes are transparent
+#ifdef __ARM_FEATURE_DSP
+    (void)__USUB8(x, 0x01010101UL);         // GE set where the byte >= 1
+    return(__SEL(0xFFFFFFFFUL, 0));
+#else
+    x = ((x & 0x7F7F7F7FUL) + 0x7F7F7F7FUL) | x;   // Bit 7 set where the byte != 0
+    return(((x >> 7) & 0x01010101UL) * 0xFFUL);
+#endif
+}
+
 /********************************************************************
 ** lcdMoveCursor(INT8U row, INT8U col)
 *
@@ -770,7 +1049,20 @@ static void lcdClear(LCD_BUFFER *buffer) {
 *  RETURNS: None
 ********************************************************************/
 static void lcdMoveCursor(INT8U row, INT8U col) {
-   lcdWrite(LCD_DD_RAM((lcdRowAddress[(row-1)]) + (col-1)));
+   lcdSetAddr((lcdRowAddress[(row-1)]) + (col-1));
+}
+
+/*************************************************************************
+  lcdSetAddr() - Sets the LCD address counter to addr unless the
+                 lcdAddr shadow shows it is already there.     (Private)
+*************************************************************************/
+static void lcdSetAddr(INT8U addr) {
+    if(addr != lcdAddr){
+        lcdWrite(LCD_DD_RAM(addr));
+        lcdAddr = addr;
+    }else{
+        lcdStats.cmdsSkipped++;
+    }
 }
 
 /********************************************************************
@@ -781,12 +1073,20 @@ static void lcdMoveCursor(INT8U row, INT8U col) {
 *  PARAMETERS: on - (Binary)Turn cursor on if TRUE, off if FALSE.
 *              blink - (Binary)Cursor blinks if TRUE.
 *
-*  DESCRIPTION: Changes LCD cursor state.
+*  DESCRIPTION: Changes LCD cursor state. Nothing is sent if the
+*               state is already set.
 *
 *  RETURNS: None
 ********************************************************************/
 void LcdCursorDispMode(INT8U on, INT8U blink) {
-    lcdWrite(LCD_ON_OFF(1, on, blink));
+    INT16U ctrl = LCD_ON_OFF(1, on, blink);
+
+    if(ctrl != lcdCtrl){
+        lcdWrite(ctrl);
+        lcdCtrl = ctrl;
+    }else{
+        lcdStats.cmdsSkipped++;
+    }
 }
 
 /********************************************************************
@@ -801,7 +1101,19 @@ void LcdCursorDispMode(INT8U on, INT8U blink) {
 *  RETURNS: None
 ********************************************************************/
 void LcdHideLayer(INT8U layer){
-    lcdLayers[layer].hidden = 1;
+    OS_ERR os_err;
+
+    OSMutexPend(&lcdLayersKey, 0, OS_OPT_PEND_BLOCKING, (CPU_TS *)0, &os_err);
+    while(os_err != OS_ERR_NONE){           /* Error Trap                        */
+    }
+    if(lcdLayers[layer].hidden == 0){
+        lcdLayers[layer].hidden = 1;
+        lcdLayers[layer].dirty = LCD_ALL_CELLS;
+    }else{
+    }
+    (void)OSMutexPost(&lcdLayersKey, OS_OPT_POST_NONE, &os_err);
+    while(os_err != OS_ERR_NONE){           /* Error Trap                        */
+    }
 }
 
 
@@ -817,7 +1129,19 @@ void LcdHideLayer(INT8U layer){
 *  RETURNS: None
 ********************************************************************/
 void LcdShowLayer(INT8U layer){
-    lcdLayers[layer].hidden = 0;
+    OS_ERR os_err;
+
+    OSMutexPend(&lcdLayersKey, 0, OS_OPT_PEND_BLOCKING, (CPU_TS *)0, &os_err);
+    while(os_err != OS_ERR_NONE){           /* Error Trap                        */
+    }
+    if(lcdLayers[layer].hidden != 0){
+        lcdLayers[layer].hidden = 0;
+        lcdLayers[layer].dirty = LCD_ALL_CELLS;
+    }else{
+    }
+    (void)OSMutexPost(&lcdLayersKey, OS_OPT_POST_NONE, &os_err);
+    while(os_err != OS_ERR_NONE){           /* Error Trap                        */
+    }
 }
 
 /********************************************************************
@@ -832,11 +1156,41 @@ void LcdShowLayer(INT8U layer){
 *  RETURNS: None
 ********************************************************************/
 void LcdToggleLayer(INT8U layer){
+    OS_ERR os_err;
+
+    OSMutexPend(&lcdLayersKey, 0, OS_OPT_PEND_BLOCKING, (CPU_TS *)0, &os_err);
+    while(os_err != OS_ERR_NONE){           /* Error Trap                        */
+    }
     if(lcdLayers[layer].hidden){
         lcdLayers[layer].hidden = 0;
     }else{
         lcdLayers[layer].hidden = 1;
     }
+    lcdLayers[layer].dirty = LCD_ALL_CELLS;
+    (void)OSMutexPost(&lcdLayersKey, OS_OPT_POST_NONE, &os_err);
+    while(os_err != OS_ERR_NONE){           /* Error Trap                        */
+    }
+}
+
+/********************************************************************
+** LcdGetStats(LCD_STATS *stats)
+*
+*  FILENAME: LcdLayered.c
+*
+*  PARAMETERS: stats - Filled with a copy of the bus counters
+*
+*  DESCRIPTION: Copies the bus counters. Comparing cmds and
+*               cmdsSkipped per repaint shows the commands saved by
+*               the address counter shadow.
+*
+*  RETURNS: None
+********************************************************************/
+void LcdGetStats(LCD_STATS *stats){
+    CPU_SR_ALLOC();
+
+    CPU_CRITICAL_ENTER();
+    *stats = lcdStats;
+    CPU_CRITICAL_EXIT();
 }
 
 /*************************************************************************
@@ -23,9 +23,26 @@
 *************************************************************************/
 #define LCD_NUM_LAYERS 2
 
+/*************************************************************************
+* Set to poll the busy flag after each write instead of waiting the
+* worst-case execution time. Needs the LCD R/W line on PTD0. With it
+* clear, R/W must be tied low.
+*************************************************************************/
+#define LCD_BUSY_POLL 0U
+
 #define FAULT_LAYER 0 // Shows what input has a Fault
 #define UI_LAYER 1 // Shows current Status (Outputs On, PWM rate/status)
 
+/*************************************************************************
+* Bus counters from LcdGetStats()                                        *
+*************************************************************************/
+typedef struct{
+    INT32U repaints;            // lcdLayeredTask() repaints
+    INT32U chars;               // Characters written
+    INT32U cmds;                // Commands written
+    INT32U cmdsSkipped;         // Address and display control commands not needed
+}LCD_STATS;
+
 /*************************************************************************
   Public Functions
 *************************************************************************/
@@ -53,5 +70,6 @@ void LcdCursorDispMode(INT8U on, INT8U blink);
 void LcdHideLayer(INT8U layer);
 void LcdShowLayer(INT8U layer);
 void LcdToggleLayer(INT8U layer);
+void LcdGetStats(LCD_STATS *stats);
 #endif
 
@@ -14,11 +14,20 @@
 #include "LcdLayered.h"
 #include "SPI.h"
 #include "PWM.h"
+#include "Speed.h"
+#include "Current.h"
+#include "Profile.h"
 
 /*****************************************************************************************
  * Defined Constants
  ****************************************************************************************/
 #define UI_TASK_MSG_Q_SIZE 0x5U // Message Queue Size for UI task
+#define UI_KEY_BATCH 8U // Key events taken from the keypad per wakeup
+#define UI_KEY_SLOTS (UI_TASK_MSG_Q_SIZE + 2U) // A full queue, the key UITask is copying and the one being written
+#define UI_KEY_RPT_BIT 0x80U // Set on keys posted for a hold/auto-repeat. Key codes are ASCII.
+#define UI_PWM_UP_KEY NUM_KEY // Held down, nudges the running PWM% up
+#define UI_PWM_DN_KEY B_KEY // Held down, nudges the running PWM% down
+#define UI_PWM_MAX 99U // Two digits on the LCD
 
  // Messages Codes
 #define NO_FAULT 0x00U // Message from MC33879 indicating no errors
@@ -51,6 +60,10 @@
 #define OUTPUT_SEV_MASK 64U
 #define OUTPUT_EGT_MASK 128U
 
+// PWM channel driving each selectable output through its INS input (SPI_PWM_OUTS)
+#define OUT_FIV_PWM_CH PWM_CH0
+#define OUT_SIX_PWM_CH PWM_CH3
+
 // Strings to display on the LCD
 #define OUT_ONE_MSG "OUT1"
 #define OUT_TWO_MSG "OUT2"
@@ -65,6 +78,15 @@
 #define SET_MSG "SET:"
 #define PWM_MSG "PWM%"
 #define NO_OUTPUT_MSG "Outputs Off"
+#define PROF_MSG "Test Cycle"
+
+// Test cycle started with C: OUT5's PWM soft-starts to 50%, steps to 100%, then soft-stops
+#define TEST_CYCLE_LOOPS 3U
+static const PROF_STEP TestCycle[] = {
+    {2000000UL, EMERGENCY_STOP, PWM_DUTY_PCT(50), 500U, (1U << OUT_FIV_PWM_CH), PROF_SPI | PROF_SCURVE},
+    {1000000UL, 0, PWM_DUTY_FULL, 200U, (1U << OUT_FIV_PWM_CH), 0},
+    {1000000UL, 0, 0, 500U, (1U << OUT_FIV_PWM_CH), PROF_SCURVE}
+};
 
 /*****************************************************************************************
 * Allocate task control blocks
@@ -82,12 +104,6 @@ static CPU_STK UITaskStk[APP_CFG_UITASK_STK_SIZE];
 static CPU_STK UISPISrvTaskStk[APP_CFG_UISPISRV_TASK_STK_SIZE];
 static CPU_STK UIKeySrvTaskStk[APP_CFG_UIKEYSRV_TASK_STK_SIZE];
 
-/*****************************************************************************************
-* Mutexes and Semaphores
-*****************************************************************************************/
-static OS_MUTEX PwmRateKey; // Consider relocating to PWM module
-static OS_SEM NewPwmRate; // Consider relocating to PWM module
-
 /*****************************************************************************************
 * Function Prototypes
 *****************************************************************************************/
@@ -97,16 +113,6 @@ static void UITask(void *p_arg);
 static void UIKeySrvTask(void *p_arg);
 static void UISPISrvTask(void *p_arg);
 
-// Non-Tasks
-static void getPwmRate(INT8U *passpwm, OS_ERR *os_err); // Consider relocating to PWM module
-static void setPwmRate(INT8U *passpwm, OS_ERR *os_err); // Consider relocating to PWM module
-
-
-/*****************************************************************************************
-* Private resources
-*****************************************************************************************/
-static INT8U pwmrate; //  Hold the duty cycle to send to PWM Module:  Consider relocating to PWM module
-
 /*****************************************************************************************
  * Enumerated Types - Used in the UI
  *****************************************************************************************/
@@ -157,12 +163,11 @@ static void AppStartTask(void *p_arg) {
     LcdInit();
     KeyInit();
     PWMInit();
+    SpeedInit();
+    CurInit();
+    ProfInit();
     GpioDBugBitsInit();
 
-    // Create Semaphores
-    OSMutexCreate(&PwmRateKey, "PWM Rate Key", &os_err); // Consider relocating to PWM module
-    OSSemCreate(&NewPwmRate, "New PWM Rate Flag", 0, &os_err); // Consider relocating to PWM module
-
     // Create Tasks
     OSTaskCreate(&UITaskTCB,
                  "UI Task",
@@ -215,31 +220,6 @@ static void AppStartTask(void *p_arg) {
 
 
 
-/*****************************************************************************************
-* getPWMRate() - Copies the contents of PWMRate into the location of the passed pointer
-*  03/04/2018 Rod Mesecar
-*  Consider relocating to PWM module
-*****************************************************************************************/
-void getPwmRate(INT8U *passpwm, OS_ERR *os_err){
-	OSMutexPend(&PwmRateKey, 0, OS_OPT_PEND_BLOCKING, (CPU_TS *)0, os_err);
-	*passpwm = pwmrate;
-	OSMutexPost(&PwmRateKey, OS_OPT_POST_NONE, os_err);
-}
-
-
-
-/*****************************************************************************************
-* setPWMRate() - Copies the contents of the location of the passed pointer into PwmRate
-* 03/04/2018 Rod Mesecar
-* Consider relocating to PWM module
-*****************************************************************************************/
-static void setPwmRate(INT8U *passpwm, OS_ERR *os_err){
-	OSMutexPend(&PwmRateKey, 0, OS_OPT_PEND_BLOCKING, (CPU_TS *)0, os_err);
-    pwmrate = *passpwm;
-	OSMutexPost(&PwmRateKey, OS_OPT_POST_NONE, os_err);
-	OSSemPost(&NewPwmRate, OS_OPT_POST_1, os_err);
-}
-
 /*****************************************************************************************
 * UITask() - Controls the user interface
 * 03/07/2018 Rod Mesecar
@@ -249,11 +229,16 @@ static void UITask(void *p_arg){
     SYS_STATE currentstate = RUNNING; // System State
     SETTING_STATE currentplace = OUT; // Setting State - Only used when in SETTING State
     INT16U copiedmsg = 0; // Local copy of the passed message
-    INT16U *queuedmsg; // Pointer to the message
+    void *queuedmsg; // Pointer to the message, INT8U or INT16U by msg_size
     OS_MSG_SIZE msg_size; // Message Size, Used to determining Sender
     INT8U whichOutput; // The Selected Output (used for Setting)
     INT8U nextPWMRate; // What to send to the PWM Module
+    INT8U whichPwm = PWM_CH0; // PWM channel of the selected output
     INT16U nextSpiMsg; // What to send to the SPI Module
+    PROF_STATUS profStatus; // Test cycle state
+    INT8U runPWMRate = 0; // PWM% of the running output, 0 if it is not on PWM
+    INT8U pwmTripped; // The running output was forced off by PWMOff()
+    CPU_SR_ALLOC();
     (void)p_arg;
 
     //Preset Screen
@@ -265,20 +250,53 @@ static void UITask(void *p_arg){
     	DB1_TURN_OFF(); // Debug Pin off
     	queuedmsg = OSTaskQPend(0, OS_OPT_PEND_BLOCKING, &msg_size, (CPU_TS *)0, &os_err); //pend on message queue
     	while(os_err != OS_ERR_NONE){}      //Error Trap
-    	copiedmsg = *queuedmsg; // Copy the message contence
+    	if (msg_size == 1){ // Copy the message contence at the sender's width
+    		copiedmsg = *(INT8U *)queuedmsg;
+    	}else{
+    		copiedmsg = *(INT16U *)queuedmsg;
+    	}
     	DB1_TURN_ON(); // Debug Pin On
 
 		// Use msg_size to figure out source
     		if (msg_size == 1){ // This would be a keypress (1 keypress == 1 byte)
     			if (copiedmsg == D_KEY){ // This is the emergency stop key. Pressing "D" will stop all motors
+    				ProfAbort(); // Stop any test cycle
+    				SPIClearSafeState(); // Everything is stopping, release outputs latched off by a fault
     				setSpiData(EMERGENCY_STOP, &os_err); //Send Ox0000 to the SPI Module
-    				setPwmRate((INT8U)EMERGENCY_STOP, &os_err); // Set the PWM Rate to 0
+    				PWMOff(); // Force the PWM outputs off now
+    				runPWMRate = 0;
     				LcdDispClrLine(STATUS_ROW,UI_LAYER);
     				LcdDispString(STATUS_ROW, FIRST_COL, UI_LAYER, NO_OUTPUT_MSG); // Update Output Status
     				LcdHideLayer(FAULT_LAYER); // Hide Fault Message (if any)
     				LcdShowLayer(UI_LAYER); //
     				currentstate = RUNNING; // Change System State
 
+    			}else if((currentstate == RUNNING) && (runPWMRate != 0)
+    			         && (((copiedmsg & ~UI_KEY_RPT_BIT) == UI_PWM_UP_KEY) || ((copiedmsg & ~UI_KEY_RPT_BIT) == UI_PWM_DN_KEY))){
+    				// Nudge the running PWM% by one, many times a second while held
+    				if (((copiedmsg & ~UI_KEY_RPT_BIT) == UI_PWM_UP_KEY) && (runPWMRate < UI_PWM_MAX)){
+    					runPWMRate++;
+    				}else if (((copiedmsg & ~UI_KEY_RPT_BIT) == UI_PWM_DN_KEY) && (runPWMRate > 1U)){
+    					runPWMRate--;
+    				}else{
+    					// At the limit
+    				}
+    				CPU_CRITICAL_ENTER(); // Keep PWMOff() out between check and write
+    				pwmTripped = PWMIsOff(whichPwm);
+    				if (pwmTripped == FALSE){ // A non-zero duty would release a tripped output
+    					PWMSetDuty(whichPwm, PWM_DUTY_PCT(runPWMRate));
+    				}else{
+    				}
+    				CPU_CRITICAL_EXIT();
+    				if (pwmTripped == FALSE){
+    					LcdDispDecByte(STATUS_ROW, UI_PWM_WRITE, UI_LAYER, runPWMRate, 0);
+    				}else{ // Tripped by the fault path, only a new setting turns it back on
+    					runPWMRate = 0;
+    				}
+
+    			}else if((copiedmsg & UI_KEY_RPT_BIT) != 0){ // Repeats only mean something above
+    				// Do nothing
+
     			}else if((currentstate == RUNNING) && (copiedmsg != D_KEY)){
     				if (copiedmsg == A_KEY){ // A is pressed, user wants to change output
     					// Change State
@@ -293,36 +311,55 @@ static void UITask(void *p_arg){
 						nextPWMRate =0;
 						nextSpiMsg = 0;
 
+    				}else if (copiedmsg == C_KEY){ // Run the test cycle
+    					runPWMRate = 0; // The profile owns the PWM now
+    					(void)ProfStart(TestCycle, (INT8U)(sizeof(TestCycle)/sizeof(TestCycle[0])), TEST_CYCLE_LOOPS);
+    					LcdDispClrLine(STATUS_ROW,UI_LAYER);
+    					LcdDispString(STATUS_ROW, FIRST_COL, UI_LAYER, PROF_MSG);
+    					LcdShowLayer(UI_LAYER);
+
+    				}else if (copiedmsg == STAR_KEY){ // Pause/resume the test cycle
+    					ProfGetStatus(&profStatus);
+    					if (profStatus.state == PROF_RUN){
+    						ProfPause();
+    					}else if (profStatus.state == PROF_PAUSED){
+    						ProfResume();
+    					}else{
+    						// Do nothing
+    					}
+
     				}else{ // Don't Care About other key presses in this state
     					// Do nothing
     				}
     			}else if((currentstate == ADJUST) && (copiedmsg != D_KEY)){
     				switch (currentplace){
     					case OUT: // Select which Output to use
-    						if (copiedmsg == FOUR_KEY){
+    						if (copiedmsg == FIV_KEY){
     							// Update UI
-    							LcdDispString(UI_ROW, UI_OUT_COL, UI_LAYER,OUT_FOU_MSG);
+    							LcdDispString(UI_ROW, UI_OUT_COL, UI_LAYER,OUT_FIV_MSG);
     							LcdDispString(UI_ROW, UI_PWM_MSG_COL, UI_LAYER, PWM_MSG);
     							LcdCursor(UI_ROW,UI_PWM_TENS, UI_LAYER, CURSOR_ON, CURSOR_BLINK);
     							LcdShowLayer(UI_LAYER);
 
     							// Update Values
-    							 whichOutput = 4;
-    							 nextSpiMsg  = OUTPUT_ONE_MASK;
+    							 whichOutput = 5;
+    							 whichPwm = OUT_FIV_PWM_CH;
+    							 nextSpiMsg  = OUTPUT_FIV_MASK;
 
     							 // Change SETTING State
     							 currentplace = TENS;
 
-    						}else if(copiedmsg == SEV_KEY) {
+    						}else if(copiedmsg == SIX_KEY) {
     							// Update UI
-    							LcdDispString(UI_ROW, UI_OUT_COL, UI_LAYER,OUT_SEV_MSG);
+    							LcdDispString(UI_ROW, UI_OUT_COL, UI_LAYER,OUT_SIX_MSG);
     							LcdDispString(UI_ROW, UI_PWM_MSG_COL, UI_LAYER, PWM_MSG);
     							LcdCursor(UI_ROW,UI_PWM_TENS, UI_LAYER, CURSOR_ON, CURSOR_BLINK);
     							LcdShowLayer(UI_LAYER);
 
     							// Update Values
-    							whichOutput = 7;
-    							nextSpiMsg  = OUTPUT_THR_MASK;
+    							whichOutput = 6;
+    							whichPwm = OUT_SIX_PWM_CH;
+    							nextSpiMsg  = OUTPUT_SIX_MASK;
 
     							// Change State
     							currentplace = TENS;
@@ -363,21 +400,21 @@ static void UITask(void *p_arg){
 								LcdCursor(UI_ROW,UI_PWM_TENS, UI_LAYER,CURSOR_ON,CURSOR_BLINK);
 
 							}else if(copiedmsg == A_KEY){ // User accepts current value displayed
+								 runPWMRate = nextPWMRate;
 								 if (nextPWMRate ==0) // Don't want PWM, just Full output
 								 {
-									 setSpiData(&nextSpiMsg,&os_err);
+									 SPIHandover(0, nextSpiMsg, whichPwm, 0, &os_err); // SPI on, then PWM off
 								 }else if (nextPWMRate !=0) // Want a PWM Rate, Can't have SPI going (See MC33879 datasheet for Details: INS5 and INS6)
 								 {
-									 setSpiData(EMERGENCY_STOP,&os_err); // Send SPI Stop Message
-									 setPwmRate(&(nextPWMRate), &os_err); // Send the PWM rate to PWM module
+									 SPIHandover(0, EMERGENCY_STOP, whichPwm, PWM_DUTY_PCT(nextPWMRate), &os_err); // PWM on, then SPI off
 								 }
 
 								//Update status Bar
 								LcdDispClear(UI_LAYER);
-								if (whichOutput == 4){
-									LcdDispString(STATUS_ROW, FIRST_COL ,UI_LAYER, OUT_FOU_MSG);
-								}else if(whichOutput == 7){
-									LcdDispString(STATUS_ROW, FIRST_COL ,UI_LAYER, OUT_SEV_MSG);
+								if (whichOutput == 5){
+									LcdDispString(STATUS_ROW, FIRST_COL ,UI_LAYER, OUT_FIV_MSG);
+								}else if(whichOutput == 6){
+									LcdDispString(STATUS_ROW, FIRST_COL ,UI_LAYER, OUT_SIX_MSG);
 								}else{ // Add more 'else if's to add more outputs
 									// Do noting
 								}
@@ -438,7 +475,12 @@ static void UITask(void *p_arg){
 
 
 /*****************************************************************************************
-* UIKeySrvTask() - Pends on KeyPend and updates UITaskMsgQ. Gives keypad data to UITask().
+* UIKeySrvTask() - Pends on key events and updates UITaskMsgQ. Gives keypad data to UITask().
+*                  Drains every queued event at once. Each press is posted from its own
+*                  slot, and a full queue is waited out, so a burst of keys is not lost.
+*                  Holds and repeats of the PWM nudge keys are posted with UI_KEY_RPT_BIT
+*                  set, and dropped rather than waited on when the queue is full, so a
+*                  held key cannot flood UITask.
 *
 * 02/09/2018, Rod Mesecar
 * 02/16/2018, Modified for UITask(). Brian Willis
@@ -447,17 +489,45 @@ static void UITask(void *p_arg){
 static void UIKeySrvTask(void *p_arg){
     OS_ERR os_err;
     (void)p_arg;
-    INT8U keypress = 0;
-    OS_MSG_SIZE msg_size = sizeof(keypress);
+    KEY_EVENT events[UI_KEY_BATCH];
+    static INT8U keypress[UI_KEY_SLOTS]; // Posted by pointer. The slot written is never queued or being copied
+    INT8U slot = 0;
+    INT8U count;
+    INT8U i;
+    OS_MSG_SIZE msg_size = sizeof(keypress[0]);
 
     while(1){
     	DB2_TURN_OFF();
-        keypress = KeyPend(0, &os_err);     //Wait for key press
-        while(os_err != OS_ERR_NONE){}      //Error Trap
-        DB2_TURN_OFF();
-
-        OSTaskQPost(&UITaskTCB, &keypress, msg_size, OS_OPT_POST_FIFO, &os_err);    //Place keypress into queue
+        count = KeyPendEvents(events, UI_KEY_BATCH, 0, &os_err);     //Wait for key events
         while(os_err != OS_ERR_NONE){}      //Error Trap
+        DB2_TURN_ON();
+
+        for(i = 0; i < count; i++){
+            if(events[i].edge == KEY_PRESS){
+                keypress[slot] = events[i].code;
+                do{
+                    OSTaskQPost(&UITaskTCB, &keypress[slot], msg_size, OS_OPT_POST_FIFO, &os_err);    //Place keypress into queue
+                    if(os_err == OS_ERR_Q_MAX){ // UITask behind, wait for room
+                        OSTimeDly(1, OS_OPT_TIME_DLY, &os_err);
+                        os_err = OS_ERR_Q_MAX;
+                    }else{
+                    }
+                }while(os_err == OS_ERR_Q_MAX);
+                while(os_err != OS_ERR_NONE){}      //Error Trap
+                slot = (slot + 1U) % UI_KEY_SLOTS;
+            }else if(((events[i].edge == KEY_HOLD) || (events[i].edge == KEY_REPEAT))
+                     && ((events[i].code == UI_PWM_UP_KEY) || (events[i].code == UI_PWM_DN_KEY))){
+                keypress[slot] = events[i].code | UI_KEY_RPT_BIT;
+                OSTaskQPost(&UITaskTCB, &keypress[slot], msg_size, OS_OPT_POST_FIFO, &os_err);
+                if(os_err == OS_ERR_NONE){
+                    slot = (slot + 1U) % UI_KEY_SLOTS;
+                }else if(os_err == OS_ERR_Q_MAX){ // Drop it, the next repeat follows
+                }else{
+                    while(os_err != OS_ERR_NONE){}      //Error Trap
+                }
+            }else{ // Releases and chords are not used by the UI
+            }
+        }
     }
 }
 
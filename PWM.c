@@ -1,8 +1,16 @@
 /*****************************************************************************************
  * PWM Module
- * This module obtains PWM rate values from the user interface and verifies the rate if
- * it's valid between 0 to 99 percent. It also changes the speed of the motor at a
- * voltage level.
+ * This module drives the PWM outputs on FTM3 channel 0 (PTE5) and channel 3 (PTE8) as
+ * edge-aligned, high-true PWM. Frequency and per-channel duty are set directly from the
+ * caller, no task is involved. The module owns the duty setpoint of each channel as a
+ * Q15 fraction of the period (PWM_DUTY_FULL is 100%).
+ * Updates are written to the FTM write buffers and loaded at the end of the current
+ * period by a software synchronization, so a period is never cut short or stretched by
+ * an update. With a ramp time set, the output duty slews to a new setpoint in the FTM3
+ * overflow ISR, one step per period, along a linear or S-curve profile.
+ * With PWM_HBRIDGE set the two channels become the legs of an H-bridge. Each leg is a
+ * complementary pair with hardware dead-time, so its high and low side can never be on
+ * together whatever the duty. PWMSetBridge() sets direction and drive.
  *
  * Nathan Gomez, 03/15/18
  ****************************************************************************************/
@@ -11,33 +19,92 @@
 #include "os.h"
 #include "K65TWR_GPIO.h"
 #include "PWM.h"
+#include "Current.h"
 
 /*****************************************************************************************
  * Defined Constants
  ****************************************************************************************/
+#define PWM_BUS_CLK 60000000UL                  //FTM system clock (bus clock), Hz
+#define PWM_PS 1U                               //Prescale Factor divide by 2
+#define PWM_CNT_CLK (PWM_BUS_CLK >> PWM_PS)     //Counter clock, Hz
+#define PWM_FREQ_MIN ((PWM_CNT_CLK / 65536UL) + 1UL)    //Lowest frequency MOD can hold
+#define PWM_FREQ_MAX (PWM_CNT_CLK / 1024UL)     //Keeps 10 bits of duty resolution
+#define PWM_RAMP_BITS 28U                       //Ramp phase fraction bits
+#define PWM_RAMP_ONE (1UL << PWM_RAMP_BITS)     //Ramp phase at the end of a ramp
+#define PWM_RAMP_SEGS 64U                       //Segments in the S-curve table
+#define PWM_RAMP_SEG_BITS (PWM_RAMP_BITS - 6U)  //Phase bits per segment
+#define PWM_RAMP_INTERP_BITS 10U                //Phase bits used to interpolate a segment
+#define PWM_LOAD_TOUT 5U                        //PWMWaitLoad() timeout, ticks, over a period
 
 /*****************************************************************************************
-* Allocate task control blocks
+* Dead-time, computed at build time from PWM_DEADTIME_NS. The dead-time counter runs on
+* the FTM system clock divided by 1, 4 or 16 (DTPS = 0, 2, 3) and holds up to 63 counts.
+* The finest prescaler that fits is used, rounding the time up.
 *****************************************************************************************/
-static OS_TCB PWMTaskTCB;
-/*****************************************************************************************
-* Allocate task stack space
-*****************************************************************************************/
-static CPU_STK PWMTaskStk[APP_CFG_PWM_TASK_STK_SIZE];
-/*****************************************************************************************
-* Function Prototypes
-*****************************************************************************************/
-static void PWMTask(void *p_arg);
+#define PWM_DT_CLKS ((PWM_DEADTIME_NS * (PWM_BUS_CLK / 1000000UL) + 999UL) / 1000UL)
+#define PWM_DT_PS ((PWM_DT_CLKS <= 63UL) ? 0UL : ((PWM_DT_CLKS + 3UL) / 4UL <= 63UL) ? 2UL : 3UL)
+#define PWM_DT_VAL ((PWM_DT_PS == 0UL) ? PWM_DT_CLKS :                                 \
+                    (PWM_DT_PS == 2UL) ? ((PWM_DT_CLKS + 3UL) / 4UL) : ((PWM_DT_CLKS + 15UL) / 16UL))
+#if (PWM_HBRIDGE != 0U) && ((PWM_DT_CLKS + 15UL) / 16UL > 63UL)
+#error "PWM_DEADTIME_NS is longer than the FTM dead-time counter can hold"
+#endif
+
 /*****************************************************************************************
 * Private resources
 *****************************************************************************************/
-static OS_SEM PWMChgFlag;
-static INT16U pwm_value = 0;
+#if PWM_HBRIDGE != 0U
+static volatile INT32U * const pwmCnV[PWM_NUM_CH] = {&FTM3_C0V, &FTM3_C2V};    //High sides
+static const INT32U pwmOutMask[PWM_NUM_CH] = {FTM_OUTMASK_CH0OM_MASK | FTM_OUTMASK_CH1OM_MASK,
+                                              FTM_OUTMASK_CH2OM_MASK | FTM_OUTMASK_CH3OM_MASK};
+#else
+static volatile INT32U * const pwmCnV[PWM_NUM_CH] = {&FTM3_C0V, &FTM3_C3V};
+static const INT32U pwmOutMask[PWM_NUM_CH] = {FTM_OUTMASK_CH0OM_MASK, FTM_OUTMASK_CH3OM_MASK};
+#endif
+static volatile INT16U pwmDuty[PWM_NUM_CH] = {0, 0};   //Duty setpoints, Q15
+static INT16U pwmOut[PWM_NUM_CH] = {0, 0};     //Duty being output, Q15
+static INT16U pwmRampStart[PWM_NUM_CH];         //Output duty when the ramp started
+static INT32U pwmRampPhase[PWM_NUM_CH] = {PWM_RAMP_ONE, PWM_RAMP_ONE};
+static INT32U pwmRampInc[PWM_NUM_CH];           //Phase step per period of the running ramp
+static INT16U pwmRampChMs[PWM_NUM_CH];          //Time and shape of the running ramp
+static INT8U pwmRampChShape[PWM_NUM_CH];
+static INT16U pwmRampMs = 0;                    //Ramp for PWMSetDuty(), set by PWMSetRamp()
+static INT8U pwmRampShape = PWM_RAMP_LINEAR;
+static INT32U pwmPeriod;                        //Counts per period, MOD + 1
+static OS_SEM pwmLoadSem;                       //Posted at the period boundary for PWMWaitLoad()
+static volatile INT8U pwmLoadWait = FALSE;      //PWMWaitLoad() pending on pwmLoadSem
+
+//Smoothstep 3t^2 - 2t^3, Q15, at t = i/PWM_RAMP_SEGS
+static const INT16U pwmSCurve[PWM_RAMP_SEGS + 1U] = {
+	    0,    24,    94,   209,   368,   569,   810,  1090,
+	 1408,  1762,  2150,  2571,  3024,  3507,  4018,  4556,
+	 5120,  5708,  6318,  6949,  7600,  8269,  8954,  9654,
+	10368, 11094, 11830, 12575, 13328, 14087, 14850, 15616,
+	16384, 17152, 17918, 18681, 19440, 20193, 20938, 21674,
+	22400, 23114, 23814, 24499, 25168, 25819, 26450, 27060,
+	27648, 28212, 28750, 29261, 29744, 30197, 30618, 31006,
+	31360, 31678, 31958, 32199, 32400, 32559, 32674, 32744,
+	32768
+};
+
+/*****************************************************************************************
+ * Private Functions
+ ****************************************************************************************/
+static void pwmSetDuty(INT8U ch, INT16U duty);
+static void pwmRampTo(INT8U ch, INT16U duty, INT16U ms, INT8U shape);
+static void pwmLoadDuty(INT8U ch, INT16U duty);
+static INT32U pwmCounts(INT16U duty);
+static void pwmLoadCnV(INT8U ch, INT32U cnv);
+static INT16U pwmRampPoint(INT8U ch, INT32U phase);
+static INT32U pwmRampCalc(INT16U ms);
+void FTM3_IRQHandler(void);
+
 /*****************************************************************************************
 * PWMInit()
-* Initializes the clocks, the Flex Timer(FTM), and the PWM outputs. The FTM requires channel
-* mode select, rising edge capture, and make the PWM channels independent. The PWM initialization
-* was able to send a few pulse widths for one time only, but for a continuous time.
+* Initializes the clocks, the Flex Timer(FTM), and the PWM outputs. Both channels are
+* independent edge-aligned PWM with 0% duty at PWM_FREQ_DEFAULT. CnV and MOD updates are
+* buffered and loaded at the counter maximum on a software sync. With PWM_HBRIDGE set,
+* channels 0/1 and 2/3 are complementary pairs with dead-time instead, starting out
+* braked (both low sides on).
 *
 * Nathan Gomez, 03/15/18
 *****************************************************************************************/
@@ -45,100 +112,468 @@ void PWMInit(void){
 
 	OS_ERR os_err;
 
-	/*Try dealing with the pulse width (duty cycle) and the period later*/
+	OSSemCreate(&pwmLoadSem, "PWM Load", 0, &os_err);
+	while(os_err != OS_ERR_NONE){}       //Error Trap
 
 	SIM_SCGC3 |= SIM_SCGC3_FTM3(1);  //Enable clock in FTM3 for PWM0 and PWM3 (found in K65 Tower datasheet)
 	SIM_SCGC5 |= SIM_SCGC5_PORTE(1); //Enable clock from Port E
 
-	PORTE_PCR5 |= PORT_PCR_MUX(6);   //Enable channel 5 of Port E
-	PORTE_PCR8 |= PORT_PCR_MUX(6);   //Enable channel 8 of Port E
+	PORTE_PCR5 = PORT_PCR_MUX(6);    //PTE5 is FTM3 Channel 0
+	PORTE_PCR8 = PORT_PCR_MUX(6);    //PTE8 is FTM3 Channel 3
 
-	SIM_SOPT8 &= SIM_SOPT8_FTM3OCH0SRC(0);   //Output at pin FTM3 Channel 0 (FTM modulation)
-	SIM_SOPT8 &= SIM_SOPT8_FTM3OCH3SRC(0);   //Output at pin FTM3 Channel 3 (FTM modulation)
+	SIM_SOPT8 &= ~(SIM_SOPT8_FTM3OCH0SRC_MASK | SIM_SOPT8_FTM3OCH3SRC_MASK); //Output FTM3 Channels 0 and 3 directly
+#if PWM_HBRIDGE != 0U
+	PORTE_PCR6 = PORT_PCR_MUX(6);    //PTE6 is FTM3 Channel 1, leg A low side
+	PORTE_PCR7 = PORT_PCR_MUX(6);    //PTE7 is FTM3 Channel 2, leg B high side
+	SIM_SOPT8 &= ~(SIM_SOPT8_FTM3OCH1SRC_MASK | SIM_SOPT8_FTM3OCH2SRC_MASK);
+#endif
 
-	FTM3_MODE |= FTM_MODE_WPDIS(1); //Disable write protection
-	FTM3_SC |= FTM_SC_TOF(1);     //FTM counter overflows at every clock edge
-	FTM3_SC |= FTM_SC_CLKS(1);    //System clock
-	FTM3_SC |= FTM_SC_CPWMS(0);   //Center-Aligned PWM Select; FTM Counter operates in Up Counting mode
-	FTM3_SC |= FTM_SC_PS(2);      //Prescale Factor divide by 4
+	FTM3_MODE = FTM_MODE_WPDIS(1);   //Disable write protection
+	FTM3_MODE |= FTM_MODE_FTMEN(1);  //Enable FTM, needed for buffered updates
+	FTM3_SC = 0;                     //Counter stopped while configuring
 
-	FTM3_CNTIN |= FTM_CNTIN_INIT(0); //Counter initial value
-	FTM3_CNT |= FTM_CNT_COUNT(0);    //Counter value
-	FTM3_MOD |= FTM_MOD_MOD(0);      //Modulo value
+	pwmPeriod = PWM_CNT_CLK / PWM_FREQ_DEFAULT;
+	CurSetPeriod(pwmPeriod << PWM_PS);  //Current sampling delays, bus clocks
+	FTM3_CNTIN = FTM_CNTIN_INIT(0);  //Counter initial value
+	FTM3_MOD = FTM_MOD_MOD(pwmPeriod - 1U);  //Modulo value
+	FTM3_CNT = FTM_CNT_COUNT(0);     //Any write resets the counter to CNTIN
 
-	FTM3_C0V |= FTM_CnV_VAL(1); //Channel 0 value
-	FTM3_C3V |= FTM_CnV_VAL(1); //Channel 3 value
+	FTM3_C0SC = FTM_CnSC_MSB(1) | FTM_CnSC_ELSB(1);  //Edge-Aligned PWM, high-true pulses
+	FTM3_C3SC = FTM_CnSC_MSB(1) | FTM_CnSC_ELSB(1);
+	FTM3_C0V = FTM_CnV_VAL(0);       //0% duty
+	FTM3_C3V = FTM_CnV_VAL(0);
 
-	FTM3_C0SC |= FTM_CnSC_ELSB(1); //Rising edge capture at Channel 0 (input capture)
-	FTM3_C0SC |= FTM_CnSC_ELSA(0);
+#if PWM_HBRIDGE != 0U
+	FTM3_C1SC = FTM_CnSC_MSB(1) | FTM_CnSC_ELSB(1);  //Complement of channel 0
+	FTM3_C2SC = FTM_CnSC_MSB(1) | FTM_CnSC_ELSB(1);
+	FTM3_C2V = FTM_CnV_VAL(0);
+	FTM3_DEADTIME = FTM_DEADTIME_DTPS(PWM_DT_PS) | FTM_DEADTIME_DTVAL(PWM_DT_VAL);
+	FTM3_COMBINE = FTM_COMBINE_COMP0(1) | FTM_COMBINE_DTEN0(1) | FTM_COMBINE_SYNCEN0(1)
+	             | FTM_COMBINE_COMP1(1) | FTM_COMBINE_DTEN1(1) | FTM_COMBINE_SYNCEN1(1); //Complementary pairs with dead-time
+#else
+	FTM3_COMBINE = FTM_COMBINE_SYNCEN0(1) | FTM_COMBINE_SYNCEN1(1); //Independent channels, CnV synchronized
+#endif
+	FTM3_SYNCONF = FTM_SYNCONF_SYNCMODE(1) | FTM_SYNCONF_SWWRBUF(1); //Enhanced sync, software trigger loads MOD/CnV
+	FTM3_SYNC = FTM_SYNC_CNTMAX(1);  //Load buffers at the end of the period
+	FTM3_OUTMASK = 0;                //Outputs enabled
 
-	FTM3_C3SC |= FTM_CnSC_ELSB(1); //Rising edge capture at Channel 3 (input capture)
-    FTM3_C3SC |= FTM_CnSC_ELSA(0);
+	FTM3_QDCTRL = FTM_QDCTRL_QUADEN(0); //Quadrature Decoder Mode disabled
+	FTM3_EXTTRIG = FTM_EXTTRIG_INITTRIGEN_MASK; //Trigger at each period start, for current sampling
 
-    FTM3_C0SC |= FTM_CnSC_MSB(1);  //Channel mode select on Channel 0 (for Edge-Aligned PWM)
+	NVIC_ClearPendingIRQ(FTM3_IRQn);
+	NVIC_EnableIRQ(FTM3_IRQn);       //Overflow interrupt is enabled only while ramping or loading
 
-    FTM3_C3SC |= FTM_CnSC_MSB(1);  //Channel mode select on Channel 3 (for Edge-Aligned PWM)
+	FTM3_SC = FTM_SC_CLKS(1) | FTM_SC_PS(PWM_PS); //System clock, up counting
+}
 
-    FTM3_COMBINE |= FTM_COMBINE_COMBINE0(0); //Channels 0 and 3 are independent
-    FTM3_COMBINE |= FTM_COMBINE_DECAPEN0(0); //Disable dual edge capture
+/*****************************************************************************************
+* PWMSetFreq()
+* Sets the PWM frequency in Hz for both channels and rescales their duty to match. Out of
+* range frequencies are clamped. The new period starts at the end of the current one.
+*****************************************************************************************/
+void PWMSetFreq(INT32U freq){
 
-    FTM3_MODE |= FTM_MODE_FTMEN(1);    //Enable FTM
+	INT8U ch;
+	CPU_SR_ALLOC();
 
-    FTM3_QDCTRL |= FTM_QDCTRL_QUADEN(0); //Quadrature Decoder Mode disabled
+	if(freq < PWM_FREQ_MIN){
+		freq = PWM_FREQ_MIN;
+	}else if(freq > PWM_FREQ_MAX){
+		freq = PWM_FREQ_MAX;
+	}else{
+	}
+	CPU_CRITICAL_ENTER();
+	pwmPeriod = PWM_CNT_CLK / freq;
+	CurSetPeriod(pwmPeriod << PWM_PS);
+	FTM3_MOD = FTM_MOD_MOD(pwmPeriod - 1U);
+	for(ch = 0; ch < PWM_NUM_CH; ch++){
+		pwmRampInc[ch] = pwmRampCalc(pwmRampChMs[ch]);
+		pwmLoadCnV(ch, pwmCounts(pwmOut[ch]));
+	}
+	FTM3_SYNC |= FTM_SYNC_SWSYNC_MASK;   //Load at the end of this period
+	CPU_CRITICAL_EXIT();
+}
 
-    OSSemCreate(&PWMChgFlag, "PWM Change Flag Semaphore", 0, &os_err); /*Create PWM change semaphore flag*/
-    while(os_err != OS_ERR_NONE){			/*Error Trap*/
-    }
+/*****************************************************************************************
+* PWMSetDuty()
+* Sets the duty setpoint of one channel, Q15 (PWM_DUTY_FULL is 100%, larger values are
+* 100%). Without a ramp the new duty takes effect at the end of the current period,
+* otherwise the output starts ramping to it from where it is now, even mid-ramp. A channel
+* forced off by PWMOff() is released by a non-zero duty. Safe to call from an ISR.
+*****************************************************************************************/
+void PWMSetDuty(INT8U ch, INT16U duty){
 
-	OSTaskCreate(&PWMTaskTCB,                  /*Create the time task*/
-	            "PWM Task ",
-	            PWMTask,
-	            (void *) 0,
-	            APP_CFG_PWM_TASK_PRIO,
-	            &PWMTaskStk[0],
-	            (APP_CFG_PWM_TASK_STK_SIZE / 10u),
-	            APP_CFG_PWM_TASK_STK_SIZE,
-	            0,
-	            0,
-	            (void *) 0,
-	            (OS_OPT_TASK_STK_CHK | OS_OPT_TASK_STK_CLR),
-	            &os_err);
-	while(os_err != OS_ERR_NONE){               /*Error Trap*/
+	CPU_SR_ALLOC();
+
+	if(ch < PWM_NUM_CH){
+		CPU_CRITICAL_ENTER();
+		pwmSetDuty(ch, duty);
+		if(duty != 0){
+			FTM3_OUTMASK &= ~pwmOutMask[ch];
+		}else{
+		}
+		CPU_CRITICAL_EXIT();
+	}else{ //No such channel
 	}
 }
 
 /*****************************************************************************************
-* PWMTask()
-* Obtains the PWM rate value from the user interface and sends it to the PWM rate block for
-* verification.
-*
-* Nathan Gomez, 03/15/18
+* PWMSetDutyRamp()
+* Like PWMSetDuty() but ramps over ms with shape instead of the PWMSetRamp() setting,
+* which is left alone. Lets a caller that owns a channel set its ramp without changing
+* the ramp of the other channels. Safe to call from an ISR.
+*****************************************************************************************/
+void PWMSetDutyRamp(INT8U ch, INT16U duty, INT16U ms, INT8U shape){
+
+	CPU_SR_ALLOC();
+
+	if(ch < PWM_NUM_CH){
+		CPU_CRITICAL_ENTER();
+		pwmRampTo(ch, duty, ms, shape);
+		if(duty != 0){
+			FTM3_OUTMASK &= ~pwmOutMask[ch];
+		}else{
+		}
+		CPU_CRITICAL_EXIT();
+	}else{ //No such channel
+	}
+}
+
+/*****************************************************************************************
+* PWMSetDutyNow()
+* Like PWMSetDuty() but never ramps: any ramp on the channel is cancelled and the duty
+* loads at the end of the current period. Safe to call from an ISR.
+*****************************************************************************************/
+void PWMSetDutyNow(INT8U ch, INT16U duty){
+
+	CPU_SR_ALLOC();
+
+	if(ch < PWM_NUM_CH){
+		CPU_CRITICAL_ENTER();
+		pwmLoadDuty(ch, duty);
+		if(duty != 0){
+			FTM3_OUTMASK &= ~pwmOutMask[ch];
+		}else{
+		}
+		CPU_CRITICAL_EXIT();
+	}else{ //No such channel
+	}
+}
+
+/*****************************************************************************************
+* PWMWaitLoad()
+* Pends until the next period boundary, where duty written before the call loads. The
+* overflow interrupt is enabled for the wait and posts pwmLoadSem. Gives up after
+* PWM_LOAD_TOUT ticks if the counter is not running. For one task at a time.
 *****************************************************************************************/
-void PWMTask(void *p_arg){
+void PWMWaitLoad(void){
 
 	OS_ERR os_err;
+	CPU_SR_ALLOC();
 
-	(void)p_arg;
+	(void)OSSemSet(&pwmLoadSem, 0, &os_err);
+	while(os_err != OS_ERR_NONE){}       //Error Trap
+	CPU_CRITICAL_ENTER();
+	if((FTM3_SC & FTM_SC_TOIE_MASK) == 0){
+		FTM3_SC &= ~FTM_SC_TOF_MASK;     //Drop the flag of a boundary already passed
+	}else{                               //Ramping, the ISR clears it
+	}
+	pwmLoadWait = TRUE;
+	FTM3_SC |= FTM_SC_TOIE_MASK;
+	CPU_CRITICAL_EXIT();
 
-	OSSemPend(&PWMChgFlag,0,OS_OPT_PEND_BLOCKING,(void*)0,&os_err); /*Send a semaphore signal to run the time display task*/
-    while(os_err != OS_ERR_NONE){           /* Error Trap */
-    }
+	(void)OSSemPend(&pwmLoadSem, PWM_LOAD_TOUT, OS_OPT_PEND_BLOCKING, (CPU_TS *)0, &os_err);
+	if(os_err == OS_ERR_TIMEOUT){
+		pwmLoadWait = FALSE;
+	}else{
+		while(os_err != OS_ERR_NONE){}   //Error Trap
+	}
 }
+
 /*****************************************************************************************
-* PWMRate()
-* Checks if the PWM rate is within the range between 1 and 99 percent. If the PWM rate is
-* 0 percent, it's ignored.
-*
-* Return: pwm_value
-*
-* Nathan Gomez, 03/15/18
+* PWMGetDuty()
+* Returns the duty setpoint of one channel, Q15. Unknown channels read as 0.
 *****************************************************************************************/
-INT16U PWMRate(void){
+INT16U PWMGetDuty(INT8U ch){
+
+	INT16U duty = 0;
+
+	if(ch < PWM_NUM_CH){
+		duty = pwmDuty[ch];
+	}else{
+	}
+	return duty;
+}
+
+/*****************************************************************************************
+* PWMIsOff()
+* Returns TRUE if a channel is held inactive by PWMOff() and not yet released by a
+* non-zero duty. Unknown channels read as off.
+*****************************************************************************************/
+INT8U PWMIsOff(INT8U ch){
+
+	INT8U off = TRUE;
+
+	if(ch < PWM_NUM_CH){
+		if((FTM3_OUTMASK & pwmOutMask[ch]) == 0){
+			off = FALSE;
+		}else{
+		}
+	}else{
+	}
+	return off;
+}
+
+/*****************************************************************************************
+* PWMSetRamp()
+* Sets the time in ms that PWMSetDuty() takes to move the output to a new setpoint, and
+* the shape of the move, PWM_RAMP_LINEAR or PWM_RAMP_SCURVE. 0 ms makes changes immediate.
+* Ramps already running finish with the time and shape they started with.
+*****************************************************************************************/
+void PWMSetRamp(INT16U ms, INT8U shape){
+
+	CPU_SR_ALLOC();
+
+	CPU_CRITICAL_ENTER();
+	pwmRampMs = ms;
+	pwmRampShape = shape;
+	CPU_CRITICAL_EXIT();
+}
+
+#if PWM_HBRIDGE != 0U
+/*****************************************************************************************
+* PWMSetBridge()
+* Drives the H-bridge. PWM_FWD puts duty on leg A with leg B held low, PWM_REV the other
+* way round, PWM_BRAKE holds both legs low (both low sides on) and PWM_COAST turns all four
+* switches off. Both legs are loaded at the same period boundary and each leg's dead-time
+* is inserted by the FTM, so a reversal never overlaps high and low sides. With a ramp
+* time set the legs ramp across, passing through brake. Any state but PWM_COAST releases
+* PWMOff(). Safe to call from an ISR.
+*****************************************************************************************/
+void PWMSetBridge(INT8U dir, INT16U duty){
+
+	CPU_SR_ALLOC();
+
+	CPU_CRITICAL_ENTER();
+	switch(dir){
+	case PWM_FWD:
+		pwmSetDuty(PWM_CH0, duty);
+		pwmSetDuty(PWM_CH3, 0);
+		FTM3_OUTMASK &= ~(pwmOutMask[PWM_CH0] | pwmOutMask[PWM_CH3]);
+		break;
+	case PWM_REV:
+		pwmSetDuty(PWM_CH0, 0);
+		pwmSetDuty(PWM_CH3, duty);
+		FTM3_OUTMASK &= ~(pwmOutMask[PWM_CH0] | pwmOutMask[PWM_CH3]);
+		break;
+	case PWM_BRAKE:
+		pwmSetDuty(PWM_CH0, 0);
+		pwmSetDuty(PWM_CH3, 0);
+		FTM3_OUTMASK &= ~(pwmOutMask[PWM_CH0] | pwmOutMask[PWM_CH3]);
+		break;
+	default: //PWM_COAST
+		FTM3_OUTMASK |= pwmOutMask[PWM_CH0] | pwmOutMask[PWM_CH3];
+		pwmSetDuty(PWM_CH0, 0);
+		pwmSetDuty(PWM_CH3, 0);
+		break;
+	}
+	CPU_CRITICAL_EXIT();
+}
+#endif
+
+/*****************************************************************************************
+* PWMOff()
+* Forces both PWM outputs to their inactive state through the output mask, which takes
+* effect immediately, and zeros their duty without ramping. Safe to call from an ISR.
+*****************************************************************************************/
+void PWMOff(void){
+
+	INT8U ch;
+	CPU_SR_ALLOC();
+
+	CPU_CRITICAL_ENTER();
+	FTM3_OUTMASK |= pwmOutMask[PWM_CH0] | pwmOutMask[PWM_CH3];	//Outputs inactive now
+	for(ch = 0; ch < PWM_NUM_CH; ch++){
+		pwmDuty[ch] = 0;
+		pwmOut[ch] = 0;
+		pwmRampPhase[ch] = PWM_RAMP_ONE;
+		pwmLoadCnV(ch, 0);
+	}
+	FTM3_SYNC |= FTM_SYNC_SWSYNC_MASK;
+	CPU_CRITICAL_EXIT();
+}
+
+/*****************************************************************************************
+* pwmSetDuty()
+* Moves a channel to a setpoint with the PWMSetRamp() ramp. Leaves the output mask alone.
+* Call with interrupts disabled.
+*****************************************************************************************/
+static void pwmSetDuty(INT8U ch, INT16U duty){
+
+	pwmRampTo(ch, duty, pwmRampMs, pwmRampShape);
+}
+
+/*****************************************************************************************
+* pwmRampTo()
+* Stores a setpoint and either loads it for the next period or starts a ramp to it over
+* ms with shape. Leaves the output mask alone. Call with interrupts disabled.
+*****************************************************************************************/
+static void pwmRampTo(INT8U ch, INT16U duty, INT16U ms, INT8U shape){
+
+	INT32U inc;
+
+	if(duty > PWM_DUTY_FULL){
+		duty = PWM_DUTY_FULL;
+	}else{
+	}
+	inc = pwmRampCalc(ms);
+	if(inc >= PWM_RAMP_ONE){
+		pwmLoadDuty(ch, duty);
+	}else{
+		pwmDuty[ch] = duty;
+		pwmRampStart[ch] = pwmOut[ch];
+		pwmRampChMs[ch] = ms;
+		pwmRampChShape[ch] = shape;
+		pwmRampInc[ch] = inc;
+		pwmRampPhase[ch] = 0;
+		FTM3_SC |= FTM_SC_TOIE_MASK;         //Step it from the overflow ISR
+	}
+}
+
+/*****************************************************************************************
+* pwmLoadDuty()
+* Sets setpoint and output duty together, ending any ramp, and loads them at the end of
+* the current period. Call with interrupts disabled.
+*****************************************************************************************/
+static void pwmLoadDuty(INT8U ch, INT16U duty){
+
+	if(duty > PWM_DUTY_FULL){
+		duty = PWM_DUTY_FULL;
+	}else{
+	}
+	pwmDuty[ch] = duty;
+	pwmOut[ch] = duty;
+	pwmRampPhase[ch] = PWM_RAMP_ONE;
+	pwmLoadCnV(ch, pwmCounts(duty));
+	FTM3_SYNC |= FTM_SYNC_SWSYNC_MASK;   //Load at the end of this period
+}
+
+/*****************************************************************************************
+* pwmCounts()
+* Converts a Q15 duty to a CnV value for the current period. PWM_DUTY_FULL gives
+* CnV > MOD, which holds the output high for the whole period.
+*****************************************************************************************/
+static INT32U pwmCounts(INT16U duty){
+
+	return (pwmPeriod * duty) >> 15;
+}
+
+/*****************************************************************************************
+* pwmLoadCnV()
+* Writes a channel's CnV buffer and moves its current sample point to the middle of the
+* new on-time. The edge-aligned on-time runs from the start of the period to CnV, and an
+* FTM count is 2^PWM_PS bus clocks. Both load at the start of the next period.
+*****************************************************************************************/
+static void pwmLoadCnV(INT8U ch, INT32U cnv){
+
+	*pwmCnV[ch] = cnv;
+	CurSetSamplePoint(ch, (cnv << PWM_PS) >> 1);
+}
+
+/*****************************************************************************************
+* pwmRampCalc()
+* Converts a ramp time in ms to a phase step per period at the current frequency,
+* PWM_RAMP_ONE for no ramp. The period count is rounded and the step rounded up, so a
+* ramp takes exactly that many periods while the step is large. The longest ramp is
+* under 2^21 periods (65535 ms at PWM_FREQ_MAX), so the step keeps at least 7 bits and
+* the ramp time is within half a period plus 0.8% of ms. Call with interrupts disabled.
+*****************************************************************************************/
+static INT32U pwmRampCalc(INT16U ms){
+
+	INT32U periods;
+	INT32U inc;
+
+	periods = (((INT32U)ms * (PWM_CNT_CLK / 1000UL)) + (pwmPeriod >> 1)) / pwmPeriod;
+	if(periods == 0){
+		inc = PWM_RAMP_ONE;
+	}else{
+		inc = (PWM_RAMP_ONE + periods - 1UL) / periods;
+	}
+	return inc;
+}
+
+/*****************************************************************************************
+* pwmRampPoint()
+* Returns the output duty of a channel at a ramp phase (0 to PWM_RAMP_ONE) between
+* pwmRampStart and the setpoint. The S-curve is interpolated from pwmSCurve[].
+*****************************************************************************************/
+static INT16U pwmRampPoint(INT8U ch, INT32U phase){
+
+	INT32U seg;
+	INT32S frac;
+	INT32S delta;
+
+	if(phase >= PWM_RAMP_ONE){
+		frac = (INT32S)PWM_DUTY_FULL;
+	}else if(pwmRampChShape[ch] == PWM_RAMP_SCURVE){
+		seg = phase >> PWM_RAMP_SEG_BITS;
+		frac = (INT32S)pwmSCurve[seg]
+		       + ((((INT32S)pwmSCurve[seg + 1U] - (INT32S)pwmSCurve[seg])
+		           * (INT32S)((phase >> (PWM_RAMP_SEG_BITS - PWM_RAMP_INTERP_BITS))
+		                      & ((1UL << PWM_RAMP_INTERP_BITS) - 1UL))) >> PWM_RAMP_INTERP_BITS);
+	}else{
+		frac = (INT32S)(phase >> (PWM_RAMP_BITS - 15U));    //Phase to Q15
+	}
+	delta = (INT32S)pwmDuty[ch] - (INT32S)pwmRampStart[ch];
+	return (INT16U)((INT32S)pwmRampStart[ch] + ((delta * frac) >> 15));
+}
+
+/*****************************************************************************************
+* FTM3_IRQHandler()
+* FTM3 overflow ISR, enabled only while a ramp is running or PWMWaitLoad() is waiting.
+* Advances each ramping channel one step and buffers the new CnV for the next period,
+* then wakes PWMWaitLoad(). DB6 is high while the ISR runs.
+*****************************************************************************************/
+void FTM3_IRQHandler(void){
 
 	OS_ERR os_err;
+	INT8U ch;
+	INT32U phase;
+	INT8U busy = FALSE;
+	CPU_SR_ALLOC();
+
+	CPU_CRITICAL_ENTER();
+	OSIntEnter();
+	CPU_CRITICAL_EXIT();
+
+	DB6_TURN_ON();
+	FTM3_SC &= ~FTM_SC_TOF_MASK;         //Read then write 0 clears TOF
+	for(ch = 0; ch < PWM_NUM_CH; ch++){
+		phase = pwmRampPhase[ch];
+		if(phase < PWM_RAMP_ONE){
+			phase += pwmRampInc[ch];
+			if(phase < PWM_RAMP_ONE){
+				busy = TRUE;
+			}else{
+				phase = PWM_RAMP_ONE;
+			}
+			pwmRampPhase[ch] = phase;
+			pwmOut[ch] = pwmRampPoint(ch, phase);
+			pwmLoadCnV(ch, pwmCounts(pwmOut[ch]));
+		}else{
+		}
+	}
+	FTM3_SYNC |= FTM_SYNC_SWSYNC_MASK;   //Load at the end of this period
+	if(pwmLoadWait == TRUE){
+		pwmLoadWait = FALSE;
+		(void)OSSemPost(&pwmLoadSem, OS_OPT_POST_1, &os_err);
+	}else{
+	}
+	if(busy == FALSE){
+		FTM3_SC &= ~FTM_SC_TOIE_MASK;    //All ramps done
+	}else{
+	}
+	DB6_TURN_OFF();
 
-	OSSemPost(&PWMChgFlag,OS_OPT_POST_1,&os_err);	/*Signal the time semaphore flag to call the time display task*/ //>>>should be after mutex post
-    while(os_err != OS_ERR_NONE){    /*Error Trap*/
-    }
-    return pwm_value;
+	OSIntExit();
 }
@@ -1,6 +1,6 @@
 /*****************************************************************************************
  * PWM header file
- * This header file contains the function prototypes of PWMInit and PWMRate.
+ * This header file contains the function prototypes and channels of the PWM module.
  *
  * Nathan Gomez, 03/15/18
  ****************************************************************************************/
@@ -8,11 +8,57 @@
 #ifndef SOURCES_PWM_H_
 #define SOURCES_PWM_H_
 
+/*****************************************************************************************
+ * Channels
+ ****************************************************************************************/
+#define PWM_CH0 0U      //FTM3 Channel 0, PTE5
+#define PWM_CH3 1U      //FTM3 Channel 3, PTE8
+#define PWM_NUM_CH 2U
+
+//Set to drive an H-bridge. PWM_CH0 becomes leg A: FTM3 Channel 0 (PTE5) high side and
+//Channel 1 (PTE6) low side. PWM_CH3 becomes leg B: Channel 2 (PTE7) high side and
+//Channel 3 (PTE8) low side. Channel duty is the high side's.
+#define PWM_HBRIDGE 0U
+#define PWM_DEADTIME_NS 500UL       //Both switches of a leg off at each edge
+
+#define PWM_FREQ_DEFAULT 20000UL   //Hz
+
+/*****************************************************************************************
+ * Duty setpoints are Q15 fractions of the period
+ ****************************************************************************************/
+#define PWM_DUTY_FULL 0x8000U                                       //100%
+#define PWM_DUTY_PCT(pct) ((INT16U)(((INT32U)(pct) * PWM_DUTY_FULL) / 100U))
+
+/*****************************************************************************************
+ * Ramp shapes for PWMSetRamp() and PWMSetDutyRamp()
+ ****************************************************************************************/
+#define PWM_RAMP_LINEAR 0U
+#define PWM_RAMP_SCURVE 1U
+
+/*****************************************************************************************
+ * H-bridge states for PWMSetBridge()
+ ****************************************************************************************/
+#define PWM_FWD 0U
+#define PWM_REV 1U
+#define PWM_BRAKE 2U
+#define PWM_COAST 3U
+
 /*****************************************************************************************
  * Public Functions
  ****************************************************************************************/
 void PWMInit(void);
-INT16U PWMRate(void);
+void PWMSetFreq(INT32U freq);
+void PWMSetDuty(INT8U ch, INT16U duty);
+void PWMSetDutyNow(INT8U ch, INT16U duty);
+void PWMSetDutyRamp(INT8U ch, INT16U duty, INT16U ms, INT8U shape);
+void PWMWaitLoad(void);
+INT16U PWMGetDuty(INT8U ch);
+INT8U PWMIsOff(INT8U ch);
+void PWMSetRamp(INT16U ms, INT8U shape);
+void PWMOff(void);
+#if PWM_HBRIDGE != 0U
+void PWMSetBridge(INT8U dir, INT16U duty);
+#endif
 
 /****************************************************************************************/
 
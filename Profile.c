@@ -0,0 +1,297 @@
+/********************************************************************
+* Profile.c - Motion profile executor
+* Plays a program of PROF_STEPs timed by PIT1, so step timing does
+* not depend on task scheduling. The PIT reloads in hardware, and
+* the length of the following step is written to LDVAL at the start
+* of each step, so step boundaries don't drift with ISR latency.
+* PIT1_IRQHandler applies each step's SPI command, PWM ramp and
+* duty. A step's ramp applies only to its own channels, the
+* PWMSetRamp() setting is left alone.
+********************************************************************/
+#include "MCUType.h"
+#include "app_cfg.h"
+#include "os.h"
+#include "SPI.h"
+#include "PWM.h"
+#include "Profile.h"
+
+#define PROF_BUS_CLK    60000000UL              //PIT clock (bus clock), Hz
+#define PROF_CLK_PER_US (PROF_BUS_CLK / 1000000UL)
+#define PROF_END        0xFFU                   //No next step
+
+/********************************************************************
+* Private Resources
+********************************************************************/
+static const PROF_STEP *profSteps;
+static INT8U profLen;
+static INT16U profLoops;                        //Passes to play, 0 = forever
+static INT8U profIdx;
+static INT16U profLoopCnt;
+static INT8U profState = PROF_IDLE;
+static INT32U profRem;                          //Counts left in the step when paused
+static INT8U profLive;                          //PWM channels released by the program
+static INT8U profOwned;                         //PWM channels any step of the program drives
+
+static INT8U profNextStep(void);
+static INT32U profCounts(INT32U us);
+static INT8U profApply(const PROF_STEP *step);
+void PIT1_IRQHandler(void);
+
+/********************************************************************
+* ProfInit() - Turns on the PIT with PIT1 stopped.
+********************************************************************/
+void ProfInit(void){
+
+    SIM_SCGC6 |= SIM_SCGC6_PIT(1);
+    PIT_MCR = PIT_MCR_FRZ(1);                   //Module on, stops in debug
+    PIT_TCTRL1 = 0;
+    PIT_TFLG1 = PIT_TFLG_TIF_MASK;
+    NVIC_ClearPendingIRQ(PIT1_IRQn);
+    NVIC_EnableIRQ(PIT1_IRQn);
+}
+
+/********************************************************************
+* ProfStart() - Starts playing len steps, loops times (0 = until
+* aborted), replacing any program already playing. The steps must
+* stay valid until the program ends. Returns FALSE for an empty
+* program.
+********************************************************************/
+INT8U ProfStart(const PROF_STEP *steps, INT8U len, INT16U loops){
+    INT8U nxt;
+    INT8U i;
+    INT8U owned = 0;
+    INT8U ok = FALSE;
+    CPU_SR_ALLOC();
+
+    if((steps != 0) && (len != 0) && (len != PROF_END)){
+        for(i = 0; i < len; i++){
+            owned |= steps[i].pwmMask;
+        }
+        CPU_CRITICAL_ENTER();
+        PIT_TCTRL1 = 0;
+        PIT_TFLG1 = PIT_TFLG_TIF_MASK;
+        NVIC_ClearPendingIRQ(PIT1_IRQn);
+        profSteps = steps;
+        profLen = len;
+        profLoops = loops;
+        profIdx = 0;
+        profLoopCnt = 0;
+        profState = PROF_RUN;
+        profLive = 0;
+        profOwned = owned;
+        CPU_CRITICAL_EXIT();
+        (void)profApply(&steps[0]);
+        CPU_CRITICAL_ENTER();
+        PIT_LDVAL1 = profCounts(steps[0].us);
+        PIT_TCTRL1 = PIT_TCTRL_TIE(1) | PIT_TCTRL_TEN(1);   //Loads step 0
+        nxt = profNextStep();
+        if(nxt != PROF_END){
+            PIT_LDVAL1 = profCounts(profSteps[nxt].us);     //Loads at the end of step 0
+        }else{
+        }
+        CPU_CRITICAL_EXIT();
+        ok = TRUE;
+    }else{
+    }
+    return ok;
+}
+
+/********************************************************************
+* ProfPause() - Freezes the program where it is. The outputs hold.
+********************************************************************/
+void ProfPause(void){
+    CPU_SR_ALLOC();
+
+    CPU_CRITICAL_ENTER();
+    if(profState == PROF_RUN){
+        if((PIT_TFLG1 & PIT_TFLG_TIF_MASK) != 0){
+            profRem = 1;                        //Step already over, next one on resume
+        }else{
+            profRem = PIT_CVAL1 + 1UL;
+        }
+        PIT_TCTRL1 = 0;
+        PIT_TFLG1 = PIT_TFLG_TIF_MASK;
+        NVIC_ClearPendingIRQ(PIT1_IRQn);
+        profState = PROF_PAUSED;
+    }else{
+    }
+    CPU_CRITICAL_EXIT();
+}
+
+/********************************************************************
+* ProfResume() - Continues a paused program with the time that was
+* left in its step.
+********************************************************************/
+void ProfResume(void){
+    INT8U nxt;
+    CPU_SR_ALLOC();
+
+    CPU_CRITICAL_ENTER();
+    if(profState == PROF_PAUSED){
+        profState = PROF_RUN;
+        PIT_LDVAL1 = profRem;
+        PIT_TCTRL1 = PIT_TCTRL_TIE(1) | PIT_TCTRL_TEN(1);
+        nxt = profNextStep();
+        if(nxt != PROF_END){
+            PIT_LDVAL1 = profCounts(profSteps[nxt].us);
+        }else{
+        }
+    }else{
+    }
+    CPU_CRITICAL_EXIT();
+}
+
+/********************************************************************
+* ProfAbort() - Stops the program and zeros the duty of the PWM
+* channels its steps drive, without a ramp. Other channels, the
+* PWMSetRamp() setting and the SPI outputs are left as they are.
+********************************************************************/
+void ProfAbort(void){
+    INT8U ch;
+    INT8U was;
+    CPU_SR_ALLOC();
+
+    CPU_CRITICAL_ENTER();
+    PIT_TCTRL1 = 0;
+    PIT_TFLG1 = PIT_TFLG_TIF_MASK;
+    NVIC_ClearPendingIRQ(PIT1_IRQn);
+    was = profState;
+    profState = PROF_IDLE;
+    CPU_CRITICAL_EXIT();
+    if((was == PROF_RUN) || (was == PROF_PAUSED)){
+        for(ch = 0; ch < PWM_NUM_CH; ch++){
+            if((profOwned & (1U << ch)) != 0){
+                PWMSetDutyNow(ch, 0);
+            }else{
+            }
+        }
+    }else{
+    }
+}
+
+/********************************************************************
+* ProfGetStatus() - Copies the executor state.
+********************************************************************/
+void ProfGetStatus(PROF_STATUS *status){
+    CPU_SR_ALLOC();
+
+    CPU_CRITICAL_ENTER();
+    status->state = profState;
+    status->step = profIdx;
+    status->loop = profLoopCnt;
+    CPU_CRITICAL_EXIT();
+}
+
+/********************************************************************
+* profNextStep() - Index of the step after profIdx, wrapping for
+* the next pass, or PROF_END after the last pass.
+********************************************************************/
+static INT8U profNextStep(void){
+    INT8U nxt;
+
+    if((profIdx + 1U) < profLen){
+        nxt = profIdx + 1U;
+    }else if((profLoops == 0) || ((profLoopCnt + 1U) < profLoops)){
+        nxt = 0;
+    }else{
+        nxt = PROF_END;
+    }
+    return nxt;
+}
+
+/********************************************************************
+* profCounts() - PIT load value for a step duration.
+********************************************************************/
+static INT32U profCounts(INT32U us){
+
+    if(us < PROF_US_MIN){
+        us = PROF_US_MIN;
+    }else if(us > PROF_US_MAX){
+        us = PROF_US_MAX;
+    }else{
+    }
+    return (us * PROF_CLK_PER_US) - 1UL;
+}
+
+/********************************************************************
+* profApply() - Sets the outputs for a step. If PWMOff() has forced
+* off a channel the program released (a fault trip or a stop), sets
+* nothing and returns TRUE, so the trip is not undone.
+********************************************************************/
+static INT8U profApply(const PROF_STEP *step){
+    OS_ERR os_err;
+    INT8U ch;
+    INT8U tripped = FALSE;
+    CPU_SR_ALLOC();
+
+    CPU_CRITICAL_ENTER();                       //Keep PWMOff() out between check and write
+    for(ch = 0; ch < PWM_NUM_CH; ch++){
+        if(((profLive & (1U << ch)) != 0) && (PWMIsOff(ch) == TRUE)){
+            tripped = TRUE;
+        }else{
+        }
+    }
+    if(tripped == FALSE){
+        for(ch = 0; ch < PWM_NUM_CH; ch++){
+            if((step->pwmMask & (1U << ch)) != 0){
+                PWMSetDutyRamp(ch, step->duty, step->rampMs,
+                               ((step->flags & PROF_SCURVE) != 0) ? PWM_RAMP_SCURVE : PWM_RAMP_LINEAR);
+                if(step->duty != 0){
+                    profLive |= (INT8U)(1U << ch);
+                }else{
+                }
+            }else{
+            }
+        }
+    }else{
+    }
+    CPU_CRITICAL_EXIT();
+    if((tripped == FALSE) && ((step->flags & PROF_SPI) != 0)){
+        SPISetDevData(0, step->spiCmd, &os_err);
+    }else{
+    }
+    return tripped;
+}
+
+/********************************************************************
+* PIT1_IRQHandler() - End of a step. Moves to the next step, queues
+* the length of the one after it and applies the step's outputs.
+* Aborts the program if the outputs were tripped off.
+********************************************************************/
+void PIT1_IRQHandler(void){
+    INT8U nxt;
+    CPU_SR_ALLOC();
+
+    CPU_CRITICAL_ENTER();
+    OSIntEnter();
+    CPU_CRITICAL_EXIT();
+
+    PIT_TFLG1 = PIT_TFLG_TIF_MASK;
+    if(profState == PROF_RUN){
+        nxt = profNextStep();
+        if(nxt == PROF_END){
+            PIT_TCTRL1 = 0;
+            profLoopCnt++;
+            profState = PROF_DONE;
+        }else{
+            if(nxt == 0){
+                profLoopCnt++;
+            }else{
+            }
+            profIdx = nxt;
+            nxt = profNextStep();
+            if(nxt != PROF_END){
+                PIT_LDVAL1 = profCounts(profSteps[nxt].us);
+            }else{
+            }
+            if(profApply(&profSteps[profIdx]) == TRUE){
+                PIT_TCTRL1 = 0;                 //Tripped, abort
+                profState = PROF_IDLE;
+            }else{
+            }
+        }
+    }else{
+    }
+
+    OSIntExit();
+}
@@ -0,0 +1,47 @@
+/********************************************************************
+* Profile.h - Header file for the motion profile executor
+********************************************************************/
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+//Step duration limits, us. The PIT counts 60 per us in 32 bits, and a
+//step must outlast the step ISR.
+#define PROF_US_MIN 50UL
+#define PROF_US_MAX 71000000UL
+
+//Step flags
+#define PROF_SPI 0x01U          //Send spiCmd to MC33879 device 0
+#define PROF_SCURVE 0x02U       //S-curve ramp instead of linear
+
+//Executor states
+#define PROF_IDLE 0U            //Never started or aborted
+#define PROF_RUN 1U
+#define PROF_PAUSED 2U
+#define PROF_DONE 3U            //Ran to the end
+
+//One program step. The outputs are set at the start of the step and
+//held for us microseconds. Programs can be const (flash) or in RAM.
+//The last step's outputs stay set when a program ends.
+typedef struct{
+    INT32U us;                  //Step duration
+    INT16U spiCmd;              //MC33879 command, with PROF_SPI
+    INT16U duty;                //Q15 duty for the channels in pwmMask
+    INT16U rampMs;              //PWM ramp time to the new duty
+    INT8U pwmMask;              //Bit n = PWM channel n
+    INT8U flags;
+}PROF_STEP;
+
+typedef struct{
+    INT8U state;
+    INT8U step;                 //Step being played
+    INT16U loop;                //Passes completed
+}PROF_STATUS;
+
+void ProfInit(void);
+INT8U ProfStart(const PROF_STEP *steps, INT8U len, INT16U loops);
+void ProfPause(void);
+void ProfResume(void);
+void ProfAbort(void);
+void ProfGetStatus(PROF_STATUS *status);
+
+#endif
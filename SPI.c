@@ -7,18 +7,149 @@
 #include "os.h"
 #include "K65TWR_GPIO.h"
 #include "SPI.h"
+#include "PWM.h"
+
+/*****************************************************************************************
+* MC33879 status word (SO). Shifted out on every frame and sampled at the falling edge of
+* CS, so it reports the outputs as set by the previous frame.
+*   SO[15:8] - Off-state open load fault, OUT8..OUT1
+*   SO[7:0]  - On-state fault (overcurrent or thermal limit), OUT8..OUT1
+* With SPI_NUM_DEVS chained parts, a frame is the commands sent twice in one CS assertion,
+* SPI_FRAME_WORDS words. The first copy is shifted through every part and comes back out
+* of the chain as the second half of the received words, so the bits the parts clocked in
+* can be compared with what was sent. The second copy is what the parts latch. The first
+* status received comes from the last device of the chain, and the last word pushed ends
+* up in the first device, so frame word i, and word SPI_FRAME_ECHO(i), map to device
+* (SPI_NUM_DEVS - 1 - i) both ways.
+* The part reports overcurrent and thermal limit on the same bit. An on-state fault on an
+* output that has already been on fault-free is decoded as thermal, one seen on the first
+* status after the output is switched on is decoded as a short.
+*****************************************************************************************/
+#define SPI_SO_OPEN(so)     ((INT8U)((so) >> 8))
+#define SPI_SO_ONFLT(so)    ((INT8U)(so))
+#define SPI_CMD_OUTS(cmd)   ((INT8U)(cmd))              //Output on/off bits of a command
+
+//Outputs whose status contradicts what drives them: an off-state fault on an output that
+//is on, or an on-state fault on an output that is off. Real faults never do. on is the
+//mask from spiOnOuts(). Outputs on a running PWM channel are sampled at an arbitrary
+//point of the period, so callers mask them out with spiPwmOuts().
+#define SPI_MISMATCH(so, on)   ((INT8U)((SPI_SO_OPEN(so) & (on))                    \
+                                        | (SPI_SO_ONFLT(so) & (INT8U)~(on))))
+#define SPI_FRAME_DEV(i)    (SPI_NUM_DEVS - 1U - (i))   //Device for frame word i
+#define SPI_FRAME_ECHO(i)   (SPI_NUM_DEVS + (i))        //Latched copy and echo of word i
+#define SPI_FRAME_WORDS     (2U * SPI_NUM_DEVS)
+
+/*****************************************************************************************
+* DSPI clock and delay settings, computed at build time from SPI_BAUD and the protocol
+* (bus) clock. K65 reference manual, SPIx_CTARn:
+*   SCK       = (fP / PBR) * ((1 + DBR) / BR)     PBR = 2,3,5,7  BR = 2,4,6,8,16..32768
+*   tCSC/tASC/tDT = (1 / fP) * Prescaler * 2^(Scaler + 1)     Prescaler = 1,3,5,7
+* The fastest SCK not above SPI_BAUD is picked, DBR only with PBR = 2 to keep a 50% duty
+* cycle. Each delay is the shortest one not below its minimum.
+*****************************************************************************************/
+#define SPI_BUS_CLK         60000000UL                  //Protocol clock, Hz
+#define SPI_LEAD_NS         200UL                       //CS assert to first SCK edge
+#define SPI_LAG_NS          200UL                       //Last SCK edge to CS negate
+#define SPI_CSOFF_NS        500UL                       //CS negated between frames
+
+#define SPI_CEIL_DIV(a, b)  (((a) + (b) - 1UL) / (b))
+#define SPI_MIN2(a, b)      (((a) <= (b)) ? (a) : (b))
+#define SPI_MIN4(a,b,c,d)   SPI_MIN2(SPI_MIN2((a), (b)), SPI_MIN2((c), (d)))
+
+//Smallest n (0-15) with 2^(n+1) >= m
+#define SPI_POW2_IDX(m)     ((m) <= 2UL ? 0UL : (m) <= 4UL ? 1UL : (m) <= 8UL ? 2UL :        \
+                             (m) <= 16UL ? 3UL : (m) <= 32UL ? 4UL : (m) <= 64UL ? 5UL :      \
+                             (m) <= 128UL ? 6UL : (m) <= 256UL ? 7UL : (m) <= 512UL ? 8UL :   \
+                             (m) <= 1024UL ? 9UL : (m) <= 2048UL ? 10UL :                      \
+                             (m) <= 4096UL ? 11UL : (m) <= 8192UL ? 12UL :                     \
+                             (m) <= 16384UL ? 13UL : (m) <= 32768UL ? 14UL : 15UL)
+
+//Baud rate: smallest BR index whose scaler is >= m, and that scaler
+#define SPI_BR_IDX(m)       ((m) <= 2UL ? 0UL : (m) <= 4UL ? 1UL : (m) <= 6UL ? 2UL :         \
+                             (m) <= 8UL ? 3UL : (SPI_POW2_IDX(m) + 1UL))
+#define SPI_BR_SCALER(i)    (((i) < 4UL) ? (2UL * ((i) + 1UL)) : (1UL << (i)))
+#define SPI_DIV_REQ         SPI_CEIL_DIV(SPI_BUS_CLK, SPI_BAUD)
+#define SPI_BR_FOR(p, d)    SPI_BR_IDX(SPI_CEIL_DIV(SPI_DIV_REQ * (1UL + (d)), (p)))
+#define SPI_DIV_FOR(p, d)   (((p) * SPI_BR_SCALER(SPI_BR_FOR((p), (d)))) / (1UL + (d)))
+#define SPI_DIV_PBR         SPI_MIN4(SPI_DIV_FOR(2UL, 0UL), SPI_DIV_FOR(3UL, 0UL),           \
+                                     SPI_DIV_FOR(5UL, 0UL), SPI_DIV_FOR(7UL, 0UL))
+#define SPI_DBR             ((SPI_DIV_FOR(2UL, 1UL) < SPI_DIV_PBR) ? 1UL : 0UL)
+#define SPI_DIV             ((SPI_DBR != 0UL) ? SPI_DIV_FOR(2UL, 1UL) : SPI_DIV_PBR)
+#define SPI_PBR_VAL         ((SPI_DBR != 0UL) ? 2UL :                                          \
+                             (SPI_DIV == SPI_DIV_FOR(2UL, 0UL)) ? 2UL :                        \
+                             (SPI_DIV == SPI_DIV_FOR(3UL, 0UL)) ? 3UL :                        \
+                             (SPI_DIV == SPI_DIV_FOR(5UL, 0UL)) ? 5UL : 7UL)
+#define SPI_PBR             ((SPI_PBR_VAL - 1UL) / 2UL)  //2,3,5,7 -> 0,1,2,3
+#define SPI_BR              SPI_BR_FOR(SPI_PBR_VAL, SPI_DBR)
+
+//Delays: bus clocks needed, then the shortest prescaler/scaler pair covering them
+#define SPI_DLY_CLKS(ns)    SPI_CEIL_DIV((ns) * (SPI_BUS_CLK / 1000000UL), 1000UL)
+#define SPI_DLY_FOR(c, p)   ((p) * (2UL << SPI_POW2_IDX(SPI_CEIL_DIV((c), (p)))))
+#define SPI_DLY_MIN(c)      SPI_MIN4(SPI_DLY_FOR((c), 1UL), SPI_DLY_FOR((c), 3UL),           \
+                                     SPI_DLY_FOR((c), 5UL), SPI_DLY_FOR((c), 7UL))
+#define SPI_DLY_PVAL(c)     ((SPI_DLY_MIN(c) == SPI_DLY_FOR((c), 1UL)) ? 1UL :                 \
+                             (SPI_DLY_MIN(c) == SPI_DLY_FOR((c), 3UL)) ? 3UL :                 \
+                             (SPI_DLY_MIN(c) == SPI_DLY_FOR((c), 5UL)) ? 5UL : 7UL)
+#define SPI_DLY_P(ns)       ((SPI_DLY_PVAL(SPI_DLY_CLKS(ns)) - 1UL) / 2UL)
+#define SPI_DLY_S(ns)       SPI_POW2_IDX(SPI_CEIL_DIV(SPI_DLY_CLKS(ns), SPI_DLY_PVAL(SPI_DLY_CLKS(ns))))
+
+#define SPI_CTAR0_VAL       (SPI_CTAR_DBR(SPI_DBR) | SPI_CTAR_FMSZ(15)                         \
+                             | SPI_CTAR_PCSSCK(SPI_DLY_P(SPI_LEAD_NS))                          \
+                             | SPI_CTAR_PASC(SPI_DLY_P(SPI_LAG_NS))                             \
+                             | SPI_CTAR_PDT(SPI_DLY_P(SPI_CSOFF_NS))                            \
+                             | SPI_CTAR_PBR(SPI_PBR)                                            \
+                             | SPI_CTAR_CSSCK(SPI_DLY_S(SPI_LEAD_NS))                           \
+                             | SPI_CTAR_ASC(SPI_DLY_S(SPI_LAG_NS))                              \
+                             | SPI_CTAR_DT(SPI_DLY_S(SPI_CSOFF_NS))                             \
+                             | SPI_CTAR_BR(SPI_BR))
+
+#if (SPI_BUS_CLK / SPI_DIV) > SPI_BAUD
+#error "SPI.c: SCK setting exceeds SPI_BAUD"
+#endif
+#if SPI_DIV_REQ > (7UL * 32768UL)
+#error "SPI.c: SPI_BAUD is below the slowest SCK"
+#endif
+
+/*****************************************************************************************
+* Command mailboxes, one per device - [31:16] sequence number, [15:0] command word
+*****************************************************************************************/
+#define SPI_BOX_SEQ_MASK    0xFFFF0000U
+#define SPI_BOX_SEQ_INC     0x00010000U
+#define SPI_BOX_SEQ(box)    ((INT16U)((box) >> 16))
+#define SPI_BOX_MSG(box)    ((INT16U)(box))
 
 static void SPITask(void *p_arg);
+static INT8U spiWaitData(INT16U *cmds, OS_TICK tout, OS_OPT opt, OS_ERR *os_err);
+static OS_TICK spiKeepAliveTout(OS_TICK last);
+static INT8U spiSendFrame(INT16U *cmds, OS_ERR *os_err);
+static void spiDecodeStatus(INT8U dev, INT16U status, INT16U cmd);
+static void spiPushWord(INT8U word);
+static INT8U spiSafeCheck(void);
+static INT8U spiOnOuts(INT8U dev, INT16U cmd);
+static INT8U spiPwmOuts(INT8U dev);
+void SPI1_IRQHandler(void);
 
-static OS_MUTEX SpiDataKey;
 static OS_SEM NewSpiData;
+static OS_SEM spiFrameDone;                                //Posted per frame while spiHandWait
 
 //Private resources
 static OS_TCB spiTaskTCB;                                  //Allocate SPI Task control block
 static CPU_STK spiTaskStk[APP_CFG_SPITASK_STK_SIZE];       //Allocate SPI Task stack space
 static OS_SEM spiFaultFlag;                                //Allocate space for Fault Detection Semaphore
-static INT8U spiFault = 0;
-static INT16U spiMsg;
+static INT8U spiFault = 0;                                 //Outputs in fault, any type
+static SPI_FAULTS spiFaults[SPI_NUM_DEVS];                 //Decoded fault bitmaps
+static INT8U spiHealthyOn[SPI_NUM_DEVS];                   //Outputs on with no fault last status
+static volatile INT32U spiCmdBox[SPI_NUM_DEVS];            //Command mailboxes
+static INT16U spiHeld[SPI_NUM_DEVS];                       //Commands the chain holds
+static INT16U spiTxMsg[SPI_FRAME_WORDS];                   //Words for the frame in flight
+static INT16U spiRxMsg[SPI_FRAME_WORDS];                   //Words shifted in during the last frame
+static INT8U spiRxCnt;                                     //Words received so far this frame
+static SPI_STATS spiStats = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}; //Frame counters
+static volatile INT8U spiHandWait = FALSE;                 //SPIHandover() waiting on frames
+static INT8U spiSafeLatch[SPI_NUM_DEVS];                   //Outputs held off by the fast path
+static INT8U spiSafeBusy = FALSE;                          //Safe-state frame in flight
+static CPU_TS spiTripTs;                                   //Timestamp of the tripping status
+static const INT8U spiPwmOut[PWM_NUM_CH] = SPI_PWM_OUTS;   //Output on each PWM channel's INS input
 
 
 /*****************************************************************************************
@@ -35,25 +166,26 @@ void SPIInit(){
     PORTE_PCR1 = PORT_PCR_MUX(2);                   //MOSI: B11 - PTE1
     PORTE_PCR3 = PORT_PCR_MUX(2);                   //MISO: B10 - PTE3
 
-    SPI1_CTAR0 |= SPI_CTAR_PBR(0);                  //Set prescalar to 2 and scalar to 8, achieves baud rate
-    SPI1_CTAR0 |= SPI_CTAR_BR(3);                   //of ~3.6MHz for a protocol clock of ~60MHz
-    SPI1_CTAR0 |= SPI_CTAR_FMSZ(15);                //Set transfer size to 16 bits
+    SPI1_CTAR0 = SPI_CTAR0_VAL;                     //SPI_BAUD, MC33879 delays, 16 bits per device
 
     SPI1_MCR &= SPI_MCR_HALT(0);                    //Disable halt mode
     SPI1_MCR |= SPI_MCR_MSTR(1);                    //Enable Master Mode
     SPI1_MCR |= SPI_MCR_PCSIS(1);                   //Set SS inactive state to 1
 
-    //Dummy transmission to set Transfer Complete Flag with SS 1
-    SPI1_PUSHR = SPI_PUSHR_TXDATA(0x0000) | SPI_PUSHR_PCS(1);
+    SPI1_SR = SPI_SR_TCF_MASK | SPI_SR_RFDF_MASK;   //Clear stale flags
+    SPI1_RSER = SPI_RSER_RFDF_RE_MASK;              //Interrupt when a received word is ready
+
+    NVIC_ClearPendingIRQ(SPI1_IRQn);
+    NVIC_EnableIRQ(SPI1_IRQn);
 
     OSSemCreate(&spiFaultFlag,                      //Create SPI Fault Flag
                "Time Change Flag",
                0,
                &os_err);
 
-    //Create Mutexs (Moved From MSPI to SPI ~Rod)
-    OSMutexCreate(&SpiDataKey, "SPI Data Key", &os_err);
     OSSemCreate(&NewSpiData, "New SPI Data Flag", 0, &os_err);
+    while(os_err != OS_ERR_NONE){}                  //Error Trap
+    OSSemCreate(&spiFrameDone, "SPI Frame Done", 0, &os_err);
 
 
     while(os_err != OS_ERR_NONE){}                  //Error Trap
@@ -75,28 +207,251 @@ void SPIInit(){
 
 
 /*****************************************************************************************
-* getSpiData() - Copies the contents of SpiData into the location of the passed pointer
-* ~Rod Mesecar
+* getSpiData() - Returns the newest command word for device 0 without blocking
 *****************************************************************************************/
-void getSpiData(INT16U *passMsg, OS_ERR *os_err){
-    OSMutexPend(&NewSpiData, 0, OS_OPT_PEND_BLOCKING, (CPU_TS *)0, os_err);
-    *passMsg = spiMsg;
-    OSMutexPost(&NewSpiData, OS_OPT_POST_NONE, os_err);
+INT16U getSpiData(void){
+    return SPI_BOX_MSG(spiCmdBox[0]);
 }
 
 /*****************************************************************************************
-* setSpiMsg() - Copies the contents of the location of the passed pointer into SpiData
+* setSpiData() - Publishes a new command word for device 0
 * ~Rod Mesecar
 *****************************************************************************************/
-void setSpiData(INT16U *passmsg, OS_ERR *os_err){
-    OSMutexPend(&SpiDataKey, 0, OS_OPT_PEND_BLOCKING, (CPU_TS *)0, os_err);
-    spiMsg = *passmsg;
-    OSMutexPost(&SpiDataKey, OS_OPT_POST_NONE, os_err);
-    OSSemPost(&NewSpiData, OS_OPT_POST_1, os_err);
+void setSpiData(INT16U msg, OS_ERR *os_err){
+    SPISetDevData(0, msg, os_err);
+}
+
+/*****************************************************************************************
+* SPISetDevData() - Publishes a new command word for one device of the chain. Never
+*                   blocks: the sequence and word are replaced together with one exclusive
+*                   store, so racing producers cannot tear it and the last writer wins.
+*                   Out of range devices are ignored.
+*****************************************************************************************/
+void SPISetDevData(INT8U dev, INT16U msg, OS_ERR *os_err){
+    INT32U box;
+
+    if(dev < SPI_NUM_DEVS){
+        do{
+            box = __LDREXW(&spiCmdBox[dev]);
+            box = ((box & SPI_BOX_SEQ_MASK) + SPI_BOX_SEQ_INC) | msg;
+        }while(__STREXW(box, &spiCmdBox[dev]) != 0);
+        (void)OSSemPost(&NewSpiData, OS_OPT_POST_1, os_err);
+    }else{ /* No such device */
+    }
+}
+
+/*****************************************************************************************
+* SPIHandover() - Moves an MC33879 output between SPI drive and PWM drive (its INS pin)
+*                 with no off-gap. The part ORs the SPI bit with the INS input, so the new
+*                 source is made before the old one is broken:
+*                 duty != 0 - PWM channel ch is loaded with duty at the next period
+*                             boundary, then msg (the output off) is sent.
+*                 duty == 0 - msg (the output on) is sent, and once the chain holds it
+*                             channel ch is zeroed at the next period boundary.
+*                 Blocks until both are in effect, at most a PWM period plus
+*                 SPI_HANDOVER_TOUT ticks. On timeout *os_err is OS_ERR_TIMEOUT and in the
+*                 duty == 0 case the PWM is left running so the output stays driven.
+*                 For one task at a time. Timing is kept in SPI_STATS.
+*****************************************************************************************/
+void SPIHandover(INT8U dev, INT16U msg, INT8U ch, INT16U duty, OS_ERR *os_err){
+    CPU_TS start;
+    CPU_TS made;
+    CPU_TS done;
+    OS_TICK deadline;
+    OS_TICK left;
+    INT8U held = FALSE;
+    CPU_SR_ALLOC();
+
+    *os_err = OS_ERR_NONE;
+    if(dev < SPI_NUM_DEVS){
+        start = OS_TS_GET();
+        if(duty != 0){
+            PWMSetDutyNow(ch, duty);
+            PWMWaitLoad();                                          //PWM now driving
+            made = OS_TS_GET();
+        }else{
+            made = start;
+        }
+
+        (void)OSSemSet(&spiFrameDone, 0, os_err);
+        spiHandWait = TRUE;
+        deadline = OSTimeGet(os_err) + SPI_HANDOVER_TOUT;
+        SPISetDevData(dev, msg, os_err);
+        while((held == FALSE) && (*os_err == OS_ERR_NONE)){
+            if(spiHeld[dev] == (msg & (INT16U)~spiSafeLatch[dev])){   //Chain holds it
+                held = TRUE;
+            }else{
+                left = deadline - OSTimeGet(os_err);
+                if((left == 0) || (left > SPI_HANDOVER_TOUT)){      //Deadline passed
+                    *os_err = OS_ERR_TIMEOUT;
+                }else{
+                    (void)OSSemPend(&spiFrameDone, left, OS_OPT_PEND_BLOCKING, (CPU_TS *)0, os_err);
+                }
+            }
+        }
+        spiHandWait = FALSE;
+
+        if(held == TRUE){
+            if(duty == 0){
+                made = OS_TS_GET();                                 //SPI now driving
+                PWMSetDutyNow(ch, 0);
+                PWMWaitLoad();
+            }else{
+            }
+            done = OS_TS_GET();
+            *os_err = OS_ERR_NONE;
+        }else{
+            done = OS_TS_GET();
+            *os_err = OS_ERR_TIMEOUT;
+        }
+
+        CPU_CRITICAL_ENTER();
+        if(held == TRUE){
+            spiStats.handovers++;
+            spiStats.handOverlap = done - made;
+        }else{
+            spiStats.handFails++;
+        }
+        spiStats.handLat = done - start;
+        if(spiStats.handLat > spiStats.handLatMax){
+            spiStats.handLatMax = spiStats.handLat;
+        }else{
+        }
+        CPU_CRITICAL_EXIT();
+    }else{ /* No such device */
+    }
+}
+
+/*****************************************************************************************
+* spiWaitData() - Blocks until a command newer than the last one taken is published for
+*                 any device or tout ticks pass (0 waits forever), then copies the newest
+*                 command of every device into cmds. Posts for commands already superseded
+*                 are absorbed without extending the wait, which ends tout ticks after the
+*                 call. With opt OS_OPT_PEND_NON_BLOCKING it never pends.
+*                 Returns TRUE if any command is new, FALSE on timeout.
+*****************************************************************************************/
+static INT8U spiWaitData(INT16U *cmds, OS_TICK tout, OS_OPT opt, OS_ERR *os_err){
+    static INT16U lastSeq[SPI_NUM_DEVS];
+    INT32U box[SPI_NUM_DEVS];
+    INT8U dev;
+    INT8U fresh = FALSE;
+    INT8U expired = FALSE;
+    OS_TICK deadline = 0;
+    OS_TICK left = 0;
+
+    if(tout != 0){
+        deadline = OSTimeGet(os_err) + tout;
+    }else{
+    }
+    while((fresh == FALSE) && (expired == FALSE)){
+        for(dev = 0; dev < SPI_NUM_DEVS; dev++){
+            box[dev] = spiCmdBox[dev];
+            if(SPI_BOX_SEQ(box[dev]) != lastSeq[dev]){
+                fresh = TRUE;
+            }else{
+            }
+        }
+        if((fresh == FALSE) && (opt == OS_OPT_PEND_NON_BLOCKING)){
+            expired = TRUE;
+        }else if(fresh == FALSE){
+            if(tout != 0){
+                left = deadline - OSTimeGet(os_err);
+                if((left == 0) || (left > tout)){                   //Deadline passed
+                    expired = TRUE;
+                }else{
+                }
+            }else{
+            }
+            if(expired == FALSE){
+                (void)OSSemPend(&NewSpiData, left, OS_OPT_PEND_BLOCKING, (CPU_TS *)0, os_err);
+                if(*os_err == OS_ERR_TIMEOUT){
+                    expired = TRUE;
+                    *os_err = OS_ERR_NONE;
+                }else{
+                    while(*os_err != OS_ERR_NONE){}                 //Error Trap
+                }
+            }else{
+            }
+        }else{
+        }
+    }
+    for(dev = 0; dev < SPI_NUM_DEVS; dev++){
+        lastSeq[dev] = SPI_BOX_SEQ(box[dev]);
+        cmds[dev] = SPI_BOX_MSG(box[dev]);
+    }
+    return fresh;
+}
+
+/*****************************************************************************************
+* spiKeepAliveTout() - Returns the pend timeout that expires SPI_KEEPALIVE_TICKS after the
+*                      frame sent at tick last. Returns 0 (forever) if keep-alive is off.
+*****************************************************************************************/
+static OS_TICK spiKeepAliveTout(OS_TICK last){
+    OS_ERR os_err;
+    OS_TICK elapsed;
+    OS_TICK tout;
+
+    if(SPI_KEEPALIVE_TICKS == 0){
+        tout = 0;
+    }else{
+        elapsed = OSTimeGet(&os_err) - last;
+        if(elapsed >= SPI_KEEPALIVE_TICKS){
+            tout = 1;
+        }else{
+            tout = SPI_KEEPALIVE_TICKS - elapsed;
+        }
+    }
+    return tout;
+}
+
+/*****************************************************************************************
+* SPIGetStats() - Copies the frame counters into the location of the passed pointer
+*****************************************************************************************/
+void SPIGetStats(SPI_STATS *stats){
+    CPU_SR_ALLOC();
+
+    CPU_CRITICAL_ENTER();
+    *stats = spiStats;
+    CPU_CRITICAL_EXIT();
+}
+
+/*****************************************************************************************
+* SPIClearSafeState() - Releases the outputs latched off by the fault fast path. They are
+*                       driven again by the next command that turns them on.
+*****************************************************************************************/
+void SPIClearSafeState(void){
+    INT8U dev;
+    CPU_SR_ALLOC();
+
+    CPU_CRITICAL_ENTER();
+    for(dev = 0; dev < SPI_NUM_DEVS; dev++){
+        spiSafeLatch[dev] = 0;
+    }
+    CPU_CRITICAL_EXIT();
+}
+
+/*****************************************************************************************
+* SPIGetFaults() - Copies the decoded fault bitmap of one device into the location of the
+*                  passed pointer. Out of range devices read as no fault.
+*****************************************************************************************/
+void SPIGetFaults(INT8U dev, SPI_FAULTS *faults){
+    CPU_SR_ALLOC();
+
+    if(dev < SPI_NUM_DEVS){
+        CPU_CRITICAL_ENTER();
+        *faults = spiFaults[dev];
+        CPU_CRITICAL_EXIT();
+    }else{
+        faults->open = 0;
+        faults->shrt = 0;
+        faults->therm = 0;
+    }
 }
 
 /*****************************************************************************************
-* SPIPend() - Pends on the SPI fault detection semaphore
+* SPIPend() - Pends on the SPI fault detection semaphore. Posted only when a decoded
+*             fault bitmap changes. Returns the outputs in fault on any device of the chain
+*             as a bitmap, bit 0 = OUT1.
 *****************************************************************************************/
 INT8U SPIPend(INT16U tout, OS_ERR *os_err){
     //Might need to be interrupt from digital input pin
@@ -106,18 +461,283 @@ INT8U SPIPend(INT16U tout, OS_ERR *os_err){
 
 /*****************************************************************************************
  * SPITask() - Controls the SPI peripheral
+ *             Starts one frame covering every device of the chain and blocks on its task
+ *             semaphore until SPI1_IRQHandler() signals the frame is complete, so the CPU
+ *             is free while the frame shifts.
+ *             New commands that match what the chain already holds are suppressed. If no
+ *             frame has gone out for SPI_KEEPALIVE_TICKS, the current commands are resent
+ *             to refresh the outputs and poll status.
+ *             A frame whose commands echo back corrupted, or whose status contradicts
+ *             the command the chain should hold, is followed straight away by another,
+ *             carrying the newest command if there is one or repeating the held one, up
+ *             to SPI_RETRY_MAX times.
  *****************************************************************************************/
 static void SPITask(void *p_arg){
     OS_ERR os_err;
-    INT16U newMsg;
+    INT16U newMsg[SPI_NUM_DEVS];
+    INT8U dev;
+    INT8U fresh;
+    INT8U same;
+    INT8U mismatch;
+    INT8U resend = FALSE;                                           //Last frame needs a retry
+    INT8U retries = 0;
+    OS_TICK lastTick;
     (void)p_arg;
 
+    lastTick = OSTimeGet(&os_err);
     while(1){
-        getSpiData(&newMsg,&os_err);
+        if(resend == TRUE){
+            fresh = spiWaitData(newMsg, 0, OS_OPT_PEND_NON_BLOCKING, &os_err);
+        }else{
+            fresh = spiWaitData(newMsg, spiKeepAliveTout(lastTick), OS_OPT_PEND_BLOCKING, &os_err);
+        }
+
+        same = TRUE;
+        for(dev = 0; dev < SPI_NUM_DEVS; dev++){
+            newMsg[dev] &= (INT16U)~spiSafeLatch[dev];              //Keep tripped outputs off
+            if(newMsg[dev] != spiHeld[dev]){
+                same = FALSE;
+            }else{
+            }
+        }
+        if((fresh == TRUE) && (same == TRUE) && (resend == FALSE)){ //Chain already holds it
+            spiStats.suppressed++;
+        }else{
+            if((fresh == FALSE) && (resend == FALSE)){
+                spiStats.keepalive++;
+            }else{
+            }
+            mismatch = spiSendFrame(newMsg, &os_err);
+            lastTick = OSTimeGet(&os_err);
+            if(spiHandWait == TRUE){
+                (void)OSSemPost(&spiFrameDone, OS_OPT_POST_1, &os_err);
+            }else{
+            }
+
+            if(mismatch == TRUE){
+                spiStats.mismatches++;
+            }else{
+            }
+            if(mismatch == FALSE){                                  //Frame landed as sent
+                resend = FALSE;
+                retries = 0;
+            }else if(retries < SPI_RETRY_MAX){                      //Send it again
+                resend = TRUE;
+                retries++;
+                spiStats.retries++;
+            }else{                                                  //Budget spent
+                resend = FALSE;
+                retries = 0;
+                spiStats.retryFails++;
+            }
+        }
+    }
+}
+
+/*****************************************************************************************
+ * spiSendFrame() - Sends cmds to the chain in one frame, blocking until the frame is
+ *                  complete, then decodes the status words against spiHeld (the commands
+ *                  held while the status was sampled) and updates spiHeld to what was
+ *                  sent, which is less than cmds if the fault fast path tripped.
+ *                  DB5 is high while the task is using the CPU for the frame.
+ *                  Returns TRUE if any command echoed back differs from the one sent,
+ *                  i.e. this frame was corrupted on the way in, or any status
+ *                  contradicts the command it was sampled under, i.e. the previous frame
+ *                  did not land as sent. Outputs driven by PWM are left out of the
+ *                  status test.
+ *****************************************************************************************/
+static INT8U spiSendFrame(INT16U *cmds, OS_ERR *os_err){
+    INT8U dev;
+    INT16U status;
+    INT8U mismatch = FALSE;
+
+    DB5_TURN_ON();
+    for(dev = 0; dev < SPI_NUM_DEVS; dev++){
+        spiTxMsg[SPI_FRAME_DEV(dev)] = cmds[dev];
+        spiTxMsg[SPI_FRAME_ECHO(SPI_FRAME_DEV(dev))] = cmds[dev];
+    }
+    spiRxCnt = 0;
+    spiStats.sent++;
+    spiPushWord(0);
+    DB5_TURN_OFF();
+
+    (void)OSTaskSemPend(0, OS_OPT_PEND_BLOCKING, (CPU_TS *)0, os_err);   //Wait for frame complete
+    while(*os_err != OS_ERR_NONE){}                                 //Error Trap
+
+    DB5_TURN_ON();
+    for(dev = 0; dev < SPI_NUM_DEVS; dev++){
+        status = spiRxMsg[SPI_FRAME_DEV(dev)];
+        if(spiRxMsg[SPI_FRAME_ECHO(SPI_FRAME_DEV(dev))] != cmds[dev]){
+            spiStats.echoErrs++;
+            mismatch = TRUE;
+        }else if((SPI_MISMATCH(status, spiOnOuts(dev, spiHeld[dev]))
+                  & (INT8U)~spiPwmOuts(dev)) != 0){
+            mismatch = TRUE;
+        }else{
+        }
+        spiDecodeStatus(dev, status, spiHeld[dev]);
+        spiHeld[dev] = spiTxMsg[SPI_FRAME_ECHO(SPI_FRAME_DEV(dev))];
+    }
+    DB5_TURN_OFF();
+    return mismatch;
+}
+
+/*****************************************************************************************
+ * spiOnOuts() - Returns the outputs of a device that are on: those on in cmd, and those
+ *               spiPwmOuts() reports driven by PWM. Safe to call from an ISR.
+ *****************************************************************************************/
+static INT8U spiOnOuts(INT8U dev, INT16U cmd){
+    return SPI_CMD_OUTS(cmd) | spiPwmOuts(dev);
+}
+
+/*****************************************************************************************
+ * spiPwmOuts() - Returns the outputs of a device driven by PWM through their INS input:
+ *                on SPI_PWM_DEV those whose PWM channel has a non-zero duty and is not
+ *                held off by PWMOff(), whoever set it. Safe to call from an ISR.
+ *****************************************************************************************/
+static INT8U spiPwmOuts(INT8U dev){
+    INT8U ch;
+    INT8U on = 0;
+
+    if(dev == SPI_PWM_DEV){
+        for(ch = 0; ch < PWM_NUM_CH; ch++){
+            if((PWMGetDuty(ch) != 0) && (PWMIsOff(ch) == FALSE)){
+                on |= spiPwmOut[ch];
+            }else{
+            }
+        }
+    }else{
+    }
+    return on;
+}
+
+/*****************************************************************************************
+ * spiPushWord() - Pushes word i of the frame in flight. All but the last word are pushed
+ *                 with CONT set so CS stays asserted across the whole chain.
+ *****************************************************************************************/
+static void spiPushWord(INT8U word){
+    if(word < (SPI_FRAME_WORDS - 1U)){
+        SPI1_PUSHR = SPI_PUSHR_TXDATA(spiTxMsg[word]) | SPI_PUSHR_PCS(1) | SPI_PUSHR_CONT_MASK;
+    }else{
+        SPI1_PUSHR = SPI_PUSHR_TXDATA(spiTxMsg[word]) | SPI_PUSHR_PCS(1);
+    }
+}
+
+/*****************************************************************************************
+ * spiDecodeStatus() - Decodes a MC33879 status word into spiFaults and posts
+ *                     spiFaultFlag if anything changed. cmd is the command that was in
+ *                     effect when the status was sampled. Outputs driven by PWM through
+ *                     their INS input are decoded as on.
+ *****************************************************************************************/
+static void spiDecodeStatus(INT8U dev, INT16U status, INT16U cmd){
+    OS_ERR os_err;
+    SPI_FAULTS faults;
+    INT8U onflt;
+    INT8U on;
+    INT8U i;
+    INT8U any = 0;
+    CPU_SR_ALLOC();
+
+    on = spiOnOuts(dev, cmd);
+    onflt = SPI_SO_ONFLT(status) & on;
+    faults.open = SPI_SO_OPEN(status) & (INT8U)~on;
+    faults.therm = onflt & spiHealthyOn[dev];
+    faults.shrt = onflt & (INT8U)~spiHealthyOn[dev];
+    spiHealthyOn[dev] = on & (INT8U)~onflt;
+
+    if((faults.open != spiFaults[dev].open) || (faults.shrt != spiFaults[dev].shrt)
+       || (faults.therm != spiFaults[dev].therm)){
+        for(i = 0; i < SPI_NUM_DEVS; i++){
+            if(i != dev){
+                any |= spiFaults[i].open | spiFaults[i].shrt | spiFaults[i].therm;
+            }else{
+                any |= faults.open | faults.shrt | faults.therm;
+            }
+        }
+        CPU_CRITICAL_ENTER();
+        spiFaults[dev] = faults;
+        spiFault = any;
+        CPU_CRITICAL_EXIT();
+        (void)OSSemPost(&spiFaultFlag, OS_OPT_POST_1, &os_err);
         while(os_err != OS_ERR_NONE){}                              //Error Trap
+    }else{ /* No change, nothing to report */
+    }
+}
 
-        while((SPI1_SR & SPI_SR_TCF_MASK) == 0){}                   //Wait for previous data to transmit
-        SPI1_SR |= SPI_SR_TCF(1);                                   //Reset Transfer Complete Flag
-        SPI1_PUSHR = SPI_PUSHR_TXDATA(newMsg) | SPI_PUSHR_PCS(1);   //Push data to transmit with SS 1
+/*****************************************************************************************
+ * SPI1_IRQHandler() - SPI1 receive ISR. Runs once per word when the word shifted in
+ *                     from the chain is ready. Saves it and pushes the next word, or
+ *                     wakes SPITask() when the last word of the frame is in.
+ *                     If the completed frame reports a fault that matches SPI_SAFE_OUTS,
+ *                     a safe-state frame is started right here and SPITask() is only
+ *                     woken once it is complete and the outputs are off.
+ *****************************************************************************************/
+void SPI1_IRQHandler(void){
+    OS_ERR os_err;
+    CPU_SR_ALLOC();
+
+    CPU_CRITICAL_ENTER();
+    OSIntEnter();
+    CPU_CRITICAL_EXIT();
+
+    if(spiSafeBusy == FALSE){
+        spiRxMsg[spiRxCnt] = (INT16U)SPI1_POPR;                     //Drain the received word
+    }else{
+        (void)SPI1_POPR;                                            //Safe frame status not used
+    }
+    SPI1_SR = SPI_SR_RFDF_MASK | SPI_SR_TCF_MASK;                   //w1c frame flags
+    spiRxCnt++;
+    if(spiRxCnt < SPI_FRAME_WORDS){
+        spiPushWord(spiRxCnt);
+    }else if(spiSafeBusy == TRUE){                                  //Outputs latched off
+        spiSafeBusy = FALSE;
+        spiStats.tripLat = OS_TS_GET() - spiTripTs;
+        if(spiStats.tripLat > spiStats.tripLatMax){
+            spiStats.tripLatMax = spiStats.tripLat;
+        }else{
+        }
+        (void)OSTaskSemPost(&spiTaskTCB, OS_OPT_POST_NONE, &os_err);
+    }else if(spiSafeCheck() == FALSE){
+        (void)OSTaskSemPost(&spiTaskTCB, OS_OPT_POST_NONE, &os_err);
+    }else{ /* Safe-state frame started, wait for it */
+    }
+
+    OSIntExit();
+}
+
+/*****************************************************************************************
+ * spiSafeCheck() - Fault fast path, called from SPI1_IRQHandler() when a frame completes.
+ *                  Any on-state fault (short or thermal) on an output in SPI_SAFE_OUTS,
+ *                  driven by SPI or by PWM through its INS input, latches that output
+ *                  off, zeros the PWM outputs and starts a frame with those outputs
+ *                  cleared. Returns TRUE if a safe-state frame was started.
+ *****************************************************************************************/
+static INT8U spiSafeCheck(void){
+    INT8U dev;
+    INT8U trip;
+    INT8U tripped = FALSE;
+
+    for(dev = 0; dev < SPI_NUM_DEVS; dev++){
+        trip = SPI_SO_ONFLT(spiRxMsg[SPI_FRAME_DEV(dev)]) & spiOnOuts(dev, spiHeld[dev])
+               & SPI_SAFE_OUTS;
+        if(trip != 0){
+            spiSafeLatch[dev] |= trip;
+            tripped = TRUE;
+        }else{
+        }
+    }
+    if(tripped == TRUE){
+        spiTripTs = OS_TS_GET();
+        PWMOff();
+        for(dev = 0; dev < SPI_NUM_DEVS; dev++){
+            spiTxMsg[SPI_FRAME_DEV(dev)] &= (INT16U)~spiSafeLatch[dev];
+            spiTxMsg[SPI_FRAME_ECHO(SPI_FRAME_DEV(dev))] &= (INT16U)~spiSafeLatch[dev];
+        }
+        spiStats.trips++;
+        spiSafeBusy = TRUE;
+        spiRxCnt = 0;
+        spiPushWord(0);
+    }else{
     }
+    return tripped;
 }
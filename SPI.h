@@ -5,9 +5,69 @@
 #ifndef SPI_H_
 #define SPI_H_
 
+//Maximum SCK rate, Hz. The fastest DSPI setting not above it is used.
+#define SPI_BAUD 5000000UL
+
+//Number of MC33879s daisy-chained on PCS0. All are updated in one CS assertion.
+#define SPI_NUM_DEVS 1U
+
+//Ticks without a frame before the current commands are resent as a keep-alive/status
+//poll. 0 disables keep-alive.
+#define SPI_KEEPALIVE_TICKS 100U
+
+//Outputs (bit 0 = OUT1) switched off straight from the SPI ISR on a short or thermal
+//fault, along with all PWM outputs. They stay off until SPIClearSafeState().
+#define SPI_SAFE_OUTS 0xFFU
+
+//Frames resent when the commands echo back corrupted or a status contradicts the command
+//the chain should hold
+#define SPI_RETRY_MAX 3U
+
+//Ticks SPIHandover() waits for the chain to take its command
+#define SPI_HANDOVER_TOUT 10U
+
+//Device of the chain whose INS inputs are wired to the PWM channels
+#define SPI_PWM_DEV 0U
+
+//MC33879 output on each PWM channel's INS input, indexed by PWM channel: IN5 (OUT5) on
+//PWM_CH0, IN6 (OUT6) on PWM_CH3. While its channel has a non-zero duty and is not held
+//off by PWMOff() it counts as on when statuses are checked.
+#define SPI_PWM_OUTS {0x10U, 0x20U}
+
+//Decoded MC33879 faults, one bit per output, bit 0 = OUT1
+typedef struct{
+    INT8U open;                 //Open load (off state)
+    INT8U shrt;                 //Short / overcurrent
+    INT8U therm;                //Thermal limit
+}SPI_FAULTS;
+
+//SPITask frame counters
+typedef struct{
+    INT32U sent;                //Frames sent, including keep-alives
+    INT32U suppressed;          //Commands dropped because the chain already held them
+    INT32U keepalive;           //Keep-alive/status poll frames
+    INT32U trips;               //Fault fast path trips
+    INT32U tripLat;             //Last fault-to-outputs-off latency, CPU_TS counts
+    INT32U tripLatMax;          //Worst fault-to-outputs-off latency, CPU_TS counts
+    INT32U mismatches;          //Corrupted frames and statuses contradicting the held command
+    INT32U echoErrs;            //Frames whose commands echoed back differing from those sent
+    INT32U retries;             //Frames resent to correct a mismatch
+    INT32U retryFails;          //Mismatches still present after SPI_RETRY_MAX retries
+    INT32U handovers;           //SPIHandover() calls completed
+    INT32U handFails;           //SPIHandover() calls that timed out
+    INT32U handLat;             //Last handover time, CPU_TS counts
+    INT32U handLatMax;          //Worst handover time, CPU_TS counts
+    INT32U handOverlap;         //Last time both SPI and PWM drove the output, CPU_TS counts
+}SPI_STATS;
+
 void SPIInit(void);
-INT8U SPIPend(INT16U tout, OS_ERR *os_err);
-void getSpiData(INT16U *passMsg, OS_ERR *os_err);
-void setSpiData(INT16U *passmsg, OS_ERR *os_err);
+INT8U SPIPend(INT16U tout, OS_ERR *os_err);
+void SPIGetFaults(INT8U dev, SPI_FAULTS *faults);
+void SPIGetStats(SPI_STATS *stats);
+void SPIClearSafeState(void);
+INT16U getSpiData(void);
+void setSpiData(INT16U msg, OS_ERR *os_err);
+void SPISetDevData(INT8U dev, INT16U msg, OS_ERR *os_err);
+void SPIHandover(INT8U dev, INT16U msg, INT8U ch, INT16U duty, OS_ERR *os_err);
 
 #endif
@@ -0,0 +1,262 @@
+/********************************************************************
+* Speed.c - Module for closed-loop motor speed control
+* The motor encoder is decoded by FTM2 in quadrature mode (PHA on
+* PTB18, PHB on PTB19). PIT0 runs a fixed-point PID at SPEED_LOOP_HZ
+* that sets the duty of one PWM channel to hold an RPM setpoint.
+* The loop runs entirely in the PIT0 ISR and makes no kernel calls.
+* Duty ramps in the PWM module should be off while it runs.
+********************************************************************/
+#include "MCUType.h"
+#include "app_cfg.h"
+#include "os.h"
+#include "K65TWR_GPIO.h"
+#include "PWM.h"
+#include "Speed.h"
+
+#define SPEED_BUS_CLK   60000000UL              //PIT and FTM clock (bus clock), Hz
+#define SPEED_RPM_NUM   ((60UL * SPEED_LOOP_HZ) / SPEED_WIN)    //Counts per window to RPM,
+                                                                //divided by SPEED_ENC_CPR
+#define SPEED_ERR_MAX   0x3FFF                  //Error clamp, keeps gain products in 32 bits
+#define SPEED_INT_MAX   ((INT32S)PWM_DUTY_FULL << 8)    //Integrator limit, Q8 duty
+
+#if ((SPEED_WIN & (SPEED_WIN - 1U)) != 0U) || (SPEED_WIN > 64U)
+#error "SPEED_WIN must be a power of 2, 64 or less"
+#endif
+
+/********************************************************************
+* Private Resources
+********************************************************************/
+static INT16U speedCnt[SPEED_WIN];              //Encoder count history
+static INT8U speedIdx;
+static INT16S speedRpm;                         //Measured speed
+static INT8U speedCh = SPEED_CH_NONE;           //Channel being driven
+static INT16U speedRef;                         //Setpoint, RPM
+static INT32S speedInt;                         //Integrator, Q8 duty
+static INT16S speedLast;                        //Speed at the last iteration, for D
+static INT16U speedOut;                         //Duty last written, Q15
+static INT8U speedLive;                         //Output released by the loop
+static INT16U speedKp = SPEED_KP;
+static INT16U speedKi = SPEED_KI;
+static INT16U speedKd = SPEED_KD;
+static SPEED_STATS speedStats;
+
+static INT16U speedPid(INT16S meas);
+void PIT0_IRQHandler(void);
+
+/********************************************************************
+* SpeedInit() - Sets up the FTM2 quadrature decoder and starts the
+* PIT0 loop timer. No channel is driven until SpeedSet().
+********************************************************************/
+void SpeedInit(void){
+    INT8U i;
+
+    SIM_SCGC6 |= SIM_SCGC6_FTM2(1) | SIM_SCGC6_PIT(1);
+    SIM_SCGC5 |= SIM_SCGC5_PORTB(1);
+    PORTB_PCR18 = PORT_PCR_MUX(6);              //FTM2_QD_PHA
+    PORTB_PCR19 = PORT_PCR_MUX(6);              //FTM2_QD_PHB
+
+    FTM2_MODE = FTM_MODE_WPDIS(1) | FTM_MODE_FTMEN(1);
+    FTM2_SC = 0;
+    FTM2_CNTIN = FTM_CNTIN_INIT(0);
+    FTM2_MOD = FTM_MOD_MOD(0xFFFFU);            //Free running, wraps both ways
+    FTM2_CNT = FTM_CNT_COUNT(0);
+    FTM2_FILTER = FTM_FILTER_CH0FVAL(4) | FTM_FILTER_CH1FVAL(4);
+    FTM2_QDCTRL = FTM_QDCTRL_QUADEN(1) | FTM_QDCTRL_PHAFLTREN(1) | FTM_QDCTRL_PHBFLTREN(1);
+    FTM2_SC = FTM_SC_CLKS(1);                   //Clocks the input filters
+
+    for(i = 0; i < SPEED_WIN; i++){
+        speedCnt[i] = 0;
+    }
+
+    PIT_MCR = PIT_MCR_FRZ(1);                   //Module on, stops in debug
+    PIT_LDVAL0 = (SPEED_BUS_CLK / SPEED_LOOP_HZ) - 1UL;
+    PIT_TFLG0 = PIT_TFLG_TIF_MASK;
+    PIT_TCTRL0 = PIT_TCTRL_TIE(1) | PIT_TCTRL_TEN(1);
+    NVIC_ClearPendingIRQ(PIT0_IRQn);
+    NVIC_EnableIRQ(PIT0_IRQn);
+}
+
+/********************************************************************
+* SpeedSet() - Puts a PWM channel under speed control at rpm. A new
+* channel starts from rest, the same channel keeps its loop state.
+* Moving the loop to another channel zeros the old one.
+********************************************************************/
+void SpeedSet(INT8U ch, INT16U rpm){
+    INT8U old;
+    CPU_SR_ALLOC();
+
+    if(ch < PWM_NUM_CH){
+        CPU_CRITICAL_ENTER();
+        old = speedCh;
+        if(old != ch){
+            speedInt = 0;
+            speedLast = speedRpm;
+            speedOut = 0;
+            speedLive = FALSE;
+            speedCh = ch;
+        }else{
+        }
+        speedRef = rpm;
+        CPU_CRITICAL_EXIT();
+        if((old != ch) && (old != SPEED_CH_NONE)){
+            PWMSetDuty(old, 0);
+        }else{
+        }
+    }else{ //No such channel
+    }
+}
+
+/********************************************************************
+* SpeedStop() - Ends speed control and zeros the channel's duty.
+********************************************************************/
+void SpeedStop(void){
+    INT8U ch;
+    CPU_SR_ALLOC();
+
+    CPU_CRITICAL_ENTER();
+    ch = speedCh;
+    speedCh = SPEED_CH_NONE;
+    CPU_CRITICAL_EXIT();
+    if(ch != SPEED_CH_NONE){
+        PWMSetDuty(ch, 0);
+    }else{
+    }
+}
+
+/********************************************************************
+* SpeedSetGains() - Sets the PID gains, Q8, Q15 duty per RPM.
+********************************************************************/
+void SpeedSetGains(INT16U kp, INT16U ki, INT16U kd){
+    CPU_SR_ALLOC();
+
+    CPU_CRITICAL_ENTER();
+    speedKp = kp;
+    speedKi = ki;
+    speedKd = kd;
+    CPU_CRITICAL_EXIT();
+}
+
+/********************************************************************
+* SpeedGetRpm() - Returns the measured speed, negative in reverse.
+* Measured whether or not a channel is under control.
+********************************************************************/
+INT16S SpeedGetRpm(void){
+    return speedRpm;
+}
+
+/********************************************************************
+* SpeedGetStats() - Copies the loop counters.
+********************************************************************/
+void SpeedGetStats(SPEED_STATS *stats){
+    CPU_SR_ALLOC();
+
+    CPU_CRITICAL_ENTER();
+    *stats = speedStats;
+    CPU_CRITICAL_EXIT();
+}
+
+/********************************************************************
+* speedPid() - One PID step. P and I act on the error, D on the
+* measurement so setpoint steps don't kick the output. The integrator
+* is clamped to the duty range and holds while the output is
+* saturated in the direction of the error. Returns Q15 duty.
+********************************************************************/
+static INT16U speedPid(INT16S meas){
+    INT32S err;
+    INT32S dmeas;
+    INT32S out;
+
+    err = (INT32S)speedRef - (INT32S)meas;
+    if(err > SPEED_ERR_MAX){
+        err = SPEED_ERR_MAX;
+    }else if(err < -SPEED_ERR_MAX){
+        err = -SPEED_ERR_MAX;
+    }else{
+    }
+    if(((speedOut < PWM_DUTY_FULL) || (err < 0)) && ((speedOut > 0) || (err > 0))){
+        speedInt += (INT32S)speedKi * err;
+        if(speedInt > SPEED_INT_MAX){
+            speedInt = SPEED_INT_MAX;
+        }else if(speedInt < 0){
+            speedInt = 0;
+        }else{
+        }
+    }else{
+    }
+    dmeas = (INT32S)meas - (INT32S)speedLast;
+    if(dmeas > SPEED_ERR_MAX){                  //Same clamp as err for the Kd product
+        dmeas = SPEED_ERR_MAX;
+    }else if(dmeas < -SPEED_ERR_MAX){
+        dmeas = -SPEED_ERR_MAX;
+    }else{
+    }
+    out = (((INT32S)speedKp * err) >> 8) + (speedInt >> 8)
+          - (((INT32S)speedKd * dmeas) >> 8);
+    speedLast = meas;
+    if(out > (INT32S)PWM_DUTY_FULL){
+        out = (INT32S)PWM_DUTY_FULL;
+    }else if(out < 0){
+        out = 0;
+    }else{
+    }
+    return (INT16U)out;
+}
+
+/********************************************************************
+* PIT0_IRQHandler() - Speed loop. Measures the speed over the last
+* SPEED_WIN periods and, with a channel under control, runs the PID
+* and writes its duty. If PWMOff() masked the channel after the loop
+* released it, the loop stops instead, so it never re-enables an output
+* the fault path turned off. DB7 is high while it runs.
+********************************************************************/
+void PIT0_IRQHandler(void){
+    INT16U cnt;
+    INT16S delta;
+    INT16U duty;
+    CPU_TS ts;
+    CPU_SR_ALLOC();
+
+    DB7_TURN_ON();
+    ts = OS_TS_GET();
+    PIT_TFLG0 = PIT_TFLG_TIF_MASK;
+
+    cnt = (INT16U)FTM2_CNT;
+    delta = (INT16S)(cnt - speedCnt[speedIdx]);     //Oldest count in the window
+    speedCnt[speedIdx] = cnt;
+    speedIdx = (speedIdx + 1U) & (SPEED_WIN - 1U);
+    speedRpm = (INT16S)(((INT32S)delta * (INT32S)SPEED_RPM_NUM) / (INT32S)SPEED_ENC_CPR);
+
+    if(speedCh != SPEED_CH_NONE){
+        CPU_CRITICAL_ENTER();                       //Keep PWMOff() out between check and write
+        if((speedLive == TRUE) && (PWMIsOff(speedCh) == TRUE)){
+            speedCh = SPEED_CH_NONE;
+            speedStats.trips++;
+        }else{
+            duty = speedPid(speedRpm);
+            if(duty != speedOut){
+                PWMSetDuty(speedCh, duty);
+                speedOut = duty;
+                if(duty != 0){
+                    speedLive = TRUE;
+                }else{
+                }
+            }else{
+            }
+        }
+        CPU_CRITICAL_EXIT();
+    }else{
+    }
+
+    ts = OS_TS_GET() - ts;
+    speedStats.loops++;
+    speedStats.loopCyc = ts;
+    if(ts > speedStats.loopCycMax){
+        speedStats.loopCycMax = ts;
+    }else{
+    }
+    if(ts > SPEED_LOOP_BUDGET){
+        speedStats.overruns++;
+    }else{
+    }
+    DB7_TURN_OFF();
+}
@@ -0,0 +1,42 @@
+/********************************************************************
+* Speed.h - Header file for the closed-loop speed control module
+********************************************************************/
+#ifndef SPEED_H_
+#define SPEED_H_
+
+//Control loop rate, Hz. PIT0 runs the loop.
+#define SPEED_LOOP_HZ 1000U
+
+//Encoder counts per motor revolution after x4 quadrature decode
+#define SPEED_ENC_CPR 2048U
+
+//Loop periods the speed is measured over. Longer is smoother but adds lag.
+#define SPEED_WIN 8U
+
+//Default PID gains, Q8, in Q15 duty per RPM of error (KI per loop period)
+#define SPEED_KP 2048U
+#define SPEED_KI 64U
+#define SPEED_KD 0U
+
+//Loop iteration budget, CPU_TS counts. Longer iterations are counted as overruns.
+#define SPEED_LOOP_BUDGET 1200U
+
+#define SPEED_CH_NONE 0xFFU     //No channel under speed control
+
+//Speed loop counters
+typedef struct{
+    INT32U loops;               //Loop iterations run
+    INT32U loopCyc;             //Last iteration time, CPU_TS counts
+    INT32U loopCycMax;          //Worst iteration time, CPU_TS counts
+    INT32U overruns;            //Iterations over SPEED_LOOP_BUDGET
+    INT32U trips;               //Loops stopped because PWMOff() forced the output off
+}SPEED_STATS;
+
+void SpeedInit(void);
+void SpeedSet(INT8U ch, INT16U rpm);
+void SpeedStop(void);
+void SpeedSetGains(INT16U kp, INT16U ki, INT16U kd);
+INT16S SpeedGetRpm(void);
+void SpeedGetStats(SPEED_STATS *stats);
+
+#endif
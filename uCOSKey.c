@@ -1,10 +1,18 @@
 /********************************************************************
 * uCOSKey.c - A keypad module that runs under MicroC/OS for a 4x4 
 * matrix keypad.
-* This version allows for multiple column keys to be pressed and 
-* mapped to a different code by changing ColTable[] in keyScan().
-* Multiple rows can not be resolved. The topmost button will be used.
+* Every scan reads all 16 switches into a bitmap, and each key is
+* debounced on its own by 2-bit vertical counters, so any number of
+* keys can be down at once. A press that leaves two or more keys down
+* also gives a chord event with the whole bitmap.
 * The keyCodeTable[] is currently set to generate ASCII codes.
+* Presses and releases are queued as timestamped events in a ring
+* with one producer (keyTask) and one consumer, so bursts of fast
+* entry are not lost. A key held for KEY_HOLD_TICKS gives a hold event
+* and then repeat events that speed up while it stays down. Hold and
+* repeat follow the most recently pressed key.
+* While no key is down all rows are held low and the task sleeps
+* until a column pin interrupt. It only scans while a key is active.
 *
 * Requires the following be defined in app_cfg.h:
 *                   APP_CFG_KEY_TASK_PRIO
@@ -30,29 +38,52 @@
 *  COL1->PTC3, COL2->PTC4, COL3->PTC5, COL4->PTC6
 *  ROW1->PTC7, ROW2->PTC8, ROW3->PTC9, ROW4->PTC10
 ********************************************************************/
-typedef enum{KEY_OFF,KEY_EDGE,KEY_VERF} KEYSTATES;
+#define KEY_SCAN_TICKS 4U       /* Scan period while a key is active */
+#define KEY_NUM_KEYS 16U
+#define KEY_NONE 0xFFU          /* No key for hold/repeat */
 #define KEY_PORT_OUT   GPIOC_PDOR
 #define KEY_PORT_DIR   GPIOC_PDDR
 #define KEY_PORT_IN	   GPIOC_PDIR
 #define COLS_MASK 0x00000078
 #define ROWS_MASK 0x00000780
+#define KEY_COL_PCR (PORT_PCR_MUX(1)|PORT_PCR_PS_MASK|PORT_PCR_PE_MASK)
+#define KEY_IRQC_FALL 0x0AU     /* Interrupt on falling edge */
+#define KEY_IRQC_OFF 0x00U
 #define DC1 (INT8U)0x11     /*ASCII control code for the A button */
 #define DC2 (INT8U)0x12     /*ASCII control code for the B button */
 #define DC3 (INT8U)0x13     /*ASCII control code for the C button */
 #define DC4 (INT8U)0x14     /*ASCII control code for the D button */
+#define KEY_FIFO_LEN 32U    /* Events queued, power of 2 */
 typedef struct{
-    INT8U buffer;
-    OS_SEM flag;
-}KEY_BUFFER;
+    KEY_EVENT ring[KEY_FIFO_LEN];
+    volatile INT8U head;    /* Written only by keyTask */
+    volatile INT8U tail;    /* Written only by the consumer */
+    INT32U drops;           /* Events lost to a full ring */
+    OS_SEM flag;            /* Posted per event, wakeup only */
+}KEY_FIFO;
 /********************************************************************
 * Private Resources
 ********************************************************************/
-static INT8U keyScan(void);         /* Makes a single keypad scan  */
+static INT16U keyScan(void);        /* Makes a single keypad scan  */
 static const INT8U keyCodeTable[16] =
    {'1','2','3',DC1,'4','5','6',DC2,'7','8','9',DC3,'*','0','#',DC4};
 static void keyDly(void);  /* Added for GPIO to settle before read */
 static void keyTask(void *p_arg);
-static KEY_BUFFER keyBuffer;
+static INT8U keyArm(void);
+static void keyColIrq(INT32U irqc);
+void PORTC_IRQHandler(void);
+static void keyPut(INT8U code, INT8U edge);
+static INT16U keyDebounce(INT16U raw);
+static void keyEdges(INT16U toggled);
+static void keyHoldRpt(void);
+static KEY_FIFO keyFifo;
+static volatile INT16U keyState = 0;    /* Debounced keys down, bit n = keyCodeTable[n] */
+static INT16U keyCnt0 = 0;              /* Vertical counter, low bits */
+static INT16U keyCnt1 = 0;              /* Vertical counter, high bits */
+static INT8U keyHeldKey = KEY_NONE;     /* Key being timed for hold/repeat */
+static INT16U keyHeld;                  /* Ticks keyHeldKey has been down */
+static INT16U keyRpt;                   /* Current repeat interval, 0 before the hold */
+static INT16U keyNext;                  /* keyHeld count of the next hold/repeat */
 /**********************************************************************************
 * Allocate task control blocks
 **********************************************************************************/
@@ -63,13 +94,83 @@ static OS_TCB keyTaskTCB;
 static CPU_STK keyTaskStk[APP_CFG_KEY_TASK_STK_SIZE];
 
 /********************************************************************
-* KeyPend() - A function to provide access to the key buffer via a
-*             semaphore.
+* KeyPend() - Returns the next key press, pending up to tout ticks
+*             (0 = forever). Release events are skipped. Returns 0 on
+*             timeout.
 *    - Public
 ********************************************************************/
 INT8U KeyPend(INT16U tout, OS_ERR *os_err){
-    OSSemPend(&(keyBuffer.flag),tout, OS_OPT_PEND_BLOCKING, (CPU_TS *)0, os_err);
-    return(keyBuffer.buffer);
+    KEY_EVENT event;
+    INT8U key = 0;
+
+    while((key == 0) && (KeyPendEvents(&event, 1, tout, os_err) != 0)){
+        if(event.edge == KEY_PRESS){
+            key = event.code;
+        }else{
+        }
+    }
+    return(key);
+}
+
+/********************************************************************
+* KeyPendEvents() - Pends up to tout ticks (0 = forever) for key
+*             events, then moves up to max of them, oldest first, to
+*             events. Returns the number moved, 0 on timeout.
+*             One consumer task only.
+*    - Public
+********************************************************************/
+INT8U KeyPendEvents(KEY_EVENT *events, INT8U max, INT16U tout, OS_ERR *os_err){
+    INT8U n = 0;
+    INT8U tail;
+
+    *os_err = OS_ERR_NONE;
+    tail = keyFifo.tail;
+    while((tail == keyFifo.head) && (*os_err == OS_ERR_NONE)){
+        (void)OSSemPend(&(keyFifo.flag), tout, OS_OPT_PEND_BLOCKING, (CPU_TS *)0, os_err);
+    }
+    while((n < max) && (tail != keyFifo.head)){
+        events[n] = keyFifo.ring[tail & (KEY_FIFO_LEN - 1U)];
+        n++;
+        tail++;
+    }
+    __DMB();                                /* Copied out before the slots are freed */
+    keyFifo.tail = tail;
+    return(n);
+}
+
+/********************************************************************
+* KeyGetDrops() - Returns the number of events lost to a full ring.
+*    - Public
+********************************************************************/
+INT32U KeyGetDrops(void){
+    return(keyFifo.drops);
+}
+
+/********************************************************************
+* KeyGetState() - Returns the debounced keys down, bit n set for
+*                 keyCodeTable[n]. Test with KeyBit().
+*    - Public
+********************************************************************/
+INT16U KeyGetState(void){
+    return(keyState);
+}
+
+/********************************************************************
+* KeyBit() - Returns the KeyGetState()/chord bitmap bit of a key code,
+*            0 for an unknown code.
+*    - Public
+********************************************************************/
+INT16U KeyBit(INT8U code){
+    INT8U i;
+    INT16U bit = 0;
+
+    for(i = 0; i < KEY_NUM_KEYS; i++){
+        if(keyCodeTable[i] == code){
+            bit = (INT16U)(1U << i);
+        }else{
+        }
+    }
+    return(bit);
 }
 
 /********************************************************************
@@ -77,25 +178,25 @@ INT8U KeyPend(INT16U tout, OS_ERR *os_err){
 *             The columns are normally set as inputs and, since they 
 *             are pulled high, they are one. Then to pull a row low
 *             during scanning, the direction for that pin is changed
-*             to an output.
+*             to an output. When idle all rows are outputs and a
+*             falling edge on any column interrupts.
 ********************************************************************/
 void KeyInit(void){
 
     OS_ERR os_err;
 	/* Key port init */
     SIM_SCGC5 |= SIM_SCGC5_PORTC_MASK;              /* Enable clock gate for PORTC */
-    PORTC_PCR3=PORT_PCR_MUX(1)|PORT_PCR_PS_MASK|PORT_PCR_PE_MASK;
-    PORTC_PCR4=PORT_PCR_MUX(1)|PORT_PCR_PS_MASK|PORT_PCR_PE_MASK;
-    PORTC_PCR5=PORT_PCR_MUX(1)|PORT_PCR_PS_MASK|PORT_PCR_PE_MASK;
-    PORTC_PCR6=PORT_PCR_MUX(1)|PORT_PCR_PS_MASK|PORT_PCR_PE_MASK;
+    keyColIrq(KEY_IRQC_OFF);
 	PORTC_PCR7=PORT_PCR_MUX(1);
 	PORTC_PCR8=PORT_PCR_MUX(1);
 	PORTC_PCR9=PORT_PCR_MUX(1);
 	PORTC_PCR10=PORT_PCR_MUX(1);
     KEY_PORT_OUT &= ~ROWS_MASK;            /* Preset all rows to zero    */
     // Initialize the Key Buffer and semaphore
-    keyBuffer.buffer = 0x00;           /* Init KeyBuffer      */
-    OSSemCreate(&(keyBuffer.flag),"Key Semaphore",0,&os_err);
+    keyFifo.head = 0;                  /* Init key event ring */
+    keyFifo.tail = 0;
+    keyFifo.drops = 0;
+    OSSemCreate(&(keyFifo.flag),"Key Semaphore",0,&os_err);
     while(os_err != OS_ERR_NONE){           /* Error Trap                        */
     }
     //Create the key task
@@ -114,99 +215,280 @@ void KeyInit(void){
                 (OS_ERR     *)&os_err);
     while(os_err != OS_ERR_NONE){           /* Error Trap                        */
     }
+    NVIC_ClearPendingIRQ(PORTC_IRQn);
+    NVIC_EnableIRQ(PORTC_IRQn);
 
 }
 
 /********************************************************************
-* KeyTask() - Read the keypad and updates KeyBuffer. 
-*             A task decomposed into states for detecting and
-*             verifying keypresses. This task should be called
-*             periodically with a period greater than the worst case
-*             switch bounce time and less than the shortest switch
-*             activation time minus the bounce time. The switch must 
-*             be released to have multiple acknowledged presses.
+* KeyTask() - Read the keypad and updates the key event ring.
+*             Every KEY_SCAN_TICKS it reads all keys and runs them
+*             through keyDebounce(). Each debounced change is queued
+*             as a press or release, and the most recently pressed
+*             key is timed for hold and repeat. The scan period times
+*             the debounce count must be longer than the worst case
+*             switch bounce.
+*             With no key down or bouncing it sleeps until the column
+*             interrupt and scans straight away on wakeup. If a column
+*             is already low when it goes to sleep, it waits a scan
+*             period instead, so keys the scan cannot resolve do not
+*             make it spin.
+*             A key still down after KEY_HOLD_TICKS gives a KEY_HOLD
+*             event, then repeats every KEY_RPT_START_TICKS,
+*             shortened by KEY_RPT_ACCEL_TICKS per repeat down to
+*             KEY_RPT_MIN_TICKS.
 * (Public)
 ********************************************************************/
 static void keyTask(void *p_arg) {
 
     OS_ERR os_err;
-    INT8U cur_key;
-    INT8U last_key = 0;
-    KEYSTATES KeyState = KEY_OFF;
+    INT16U toggled;
     (void)p_arg;
     while(1){
-		DB1_TURN_OFF();
-        OSTimeDly(8,OS_OPT_TIME_PERIODIC,&os_err);
-		DB1_TURN_ON();
-        while(os_err != OS_ERR_NONE){           /* Error Trap                        */
+        if(((keyState | keyCnt0 | keyCnt1) == 0) && (keyArm() == FALSE)){  /* Idle, sleep until a column edge */
+            DB1_TURN_OFF();
+            (void)OSTaskSemPend(0, OS_OPT_PEND_BLOCKING, (CPU_TS *)0, &os_err);
+            DB1_TURN_ON();
+            while(os_err != OS_ERR_NONE){           /* Error Trap                        */
+            }
+        }else{ /* Scanning, or a column already low when arming (bounce or a ghost) */
+            keyColIrq(KEY_IRQC_OFF);
+            DB1_TURN_OFF();
+            OSTimeDly(KEY_SCAN_TICKS,OS_OPT_TIME_PERIODIC,&os_err);
+            DB1_TURN_ON();
+            while(os_err != OS_ERR_NONE){           /* Error Trap                        */
+            }
+        }
+        toggled = keyDebounce(keyScan());
+        if(toggled != 0){
+            keyEdges(toggled);
+        }else{
         }
-        cur_key = keyScan();
-        if(KeyState == KEY_OFF){    /* Key released state */
-            if(cur_key != 0){
-                KeyState = KEY_EDGE;
-            }else{ /* wait for key press */
+        keyHoldRpt();
+    }
+}
+
+/********************************************************************
+* keyDebounce() - Per-key debounce of one raw scan, all 16 keys in
+*                 parallel. Bit n of keyCnt1:keyCnt0 counts the scans
+*                 in a row that key n has read differently from its
+*                 debounced state. A scan that agrees clears the
+*                 count, and the fourth disagreeing scan flips the
+*                 state. Returns the keys that flipped.
+* (Private)
+********************************************************************/
+static INT16U keyDebounce(INT16U raw){
+    INT16U delta;
+    INT16U toggled;
+
+    delta = raw ^ keyState;
+    toggled = delta & keyCnt1 & keyCnt0;    /* Count was 3 */
+    keyCnt1 = (keyCnt1 ^ keyCnt0) & delta;
+    keyCnt0 = (INT16U)~keyCnt0 & delta;
+    keyState ^= toggled;
+    return(toggled);
+}
+
+/********************************************************************
+* keyEdges() - Queues a release or press for each flipped key,
+*              releases first. A press that leaves two or more keys
+*              down also queues a KEY_CHORD for that key. The last
+*              key pressed becomes the hold/repeat key.
+* (Private)
+********************************************************************/
+static void keyEdges(INT16U toggled){
+    INT8U i;
+    INT16U bit;
+
+    for(i = 0; i < KEY_NUM_KEYS; i++){
+        bit = (INT16U)(1U << i);
+        if(((toggled & bit) != 0) && ((keyState & bit) == 0)){
+            keyPut(keyCodeTable[i], KEY_RELEASE);
+            if(keyHeldKey == i){
+                keyHeldKey = KEY_NONE;
+            }else{
             }
-        }else if(KeyState == KEY_EDGE){     /* Keypress detected state*/
-            if(cur_key == last_key){        /* Keypress verified */
-                KeyState = KEY_VERF;
-                keyBuffer.buffer = keyCodeTable[cur_key - 1]; /*update buffer */
-                (void)OSSemPost(&(keyBuffer.flag), OS_OPT_POST_1, &os_err);   /* Signal new data in buffer */
-                while(os_err != OS_ERR_NONE){           /* Error Trap                        */
-                }
-            }else if( cur_key == 0){        /* Unvalidated, start over */
-                KeyState = KEY_OFF;
-            }else{                          /*Unvalidated, diff key edge*/
+        }else{
+        }
+    }
+    for(i = 0; i < KEY_NUM_KEYS; i++){
+        bit = (INT16U)(1U << i);
+        if(((toggled & bit) != 0) && ((keyState & bit) != 0)){
+            keyPut(keyCodeTable[i], KEY_PRESS);
+            if((keyState & (keyState - 1U)) != 0){     /* Two or more down */
+                keyPut(keyCodeTable[i], KEY_CHORD);
+            }else{
             }
-        }else if(KeyState == KEY_VERF){     /* Keypress verified state */
-            if((cur_key == 0) || (cur_key != last_key)){
-                KeyState = KEY_OFF;
-            }else{ /* wait for release or key change */
+            keyHeldKey = i;
+            keyHeld = 0;
+            keyRpt = 0;
+            keyNext = KEY_HOLD_TICKS;
+        }else{
+        }
+    }
+}
+
+/********************************************************************
+* keyHoldRpt() - Times the hold/repeat key for one scan period and
+*                queues its KEY_HOLD and KEY_REPEAT events.
+* (Private)
+********************************************************************/
+static void keyHoldRpt(void){
+
+    if(keyHeldKey != KEY_NONE){
+        keyHeld += KEY_SCAN_TICKS;
+        if(keyHeld >= keyNext){
+            if(keyRpt == 0){
+                keyPut(keyCodeTable[keyHeldKey], KEY_HOLD);
+                keyRpt = KEY_RPT_START_TICKS;
+            }else{
+                keyPut(keyCodeTable[keyHeldKey], KEY_REPEAT);
+                if(keyRpt >= (KEY_RPT_MIN_TICKS + KEY_RPT_ACCEL_TICKS)){
+                    keyRpt -= KEY_RPT_ACCEL_TICKS;
+                }else{
+                    keyRpt = KEY_RPT_MIN_TICKS;
+                }
             }
-        }else{ /* In case of error */
-            KeyState = KEY_OFF;             /* Should never get here */
+            keyHeld = 0;                    /* Time to the next one */
+            keyNext = keyRpt;
+        }else{
         }
-        last_key = cur_key;                 /* Save key for next time */
-    
+    }else{
     }
 }
 
 /********************************************************************
-* keyScan() - Scans the keypad and returns a keycode.
+* keyPut() - Queues a key event stamped with the current tick and
+*            wakes the consumer. Called from keyTask only. A full ring
+*            drops the event and counts it.
+* (Private)
+********************************************************************/
+static void keyPut(INT8U code, INT8U edge){
+
+    OS_ERR os_err;
+    INT8U head;
+    KEY_EVENT *event;
+
+    head = keyFifo.head;
+    if((INT8U)(head - keyFifo.tail) < KEY_FIFO_LEN){
+        event = &keyFifo.ring[head & (KEY_FIFO_LEN - 1U)];
+        event->code = code;
+        event->edge = edge;
+        event->keys = keyState;
+        event->ts = OSTimeGet(&os_err);
+        __DMB();                            /* Event stored before it is published */
+        keyFifo.head = head + 1U;
+        (void)OSSemPost(&(keyFifo.flag), OS_OPT_POST_1, &os_err);   /* Signal new event */
+        while(os_err != OS_ERR_NONE){           /* Error Trap                        */
+        }
+    }else{
+        keyFifo.drops++;
+    }
+}
+
+/********************************************************************
+* keyArm() - Holds all rows low and arms the column interrupts, so
+*            any key press pulls a column low. Returns TRUE if a
+*            column is already low.
+* (Private)
+********************************************************************/
+static INT8U keyArm(void){
+
+    OS_ERR os_err;
+    INT8U down = FALSE;
+
+    KEY_PORT_OUT &= ~ROWS_MASK;
+    KEY_PORT_DIR |= ROWS_MASK;              /* All rows low */
+    keyDly();
+    (void)OSTaskSemSet((OS_TCB *)0, 0, &os_err);    /* Drop stale wakeups */
+    PORTC_ISFR = COLS_MASK;
+    keyColIrq(KEY_IRQC_FALL);
+    if(((~KEY_PORT_IN) & COLS_MASK) != 0){
+        down = TRUE;
+    }else{
+    }
+    return down;
+}
+
+/********************************************************************
+* keyColIrq() - Sets the interrupt mode of the column pins.
+* (Private)
+********************************************************************/
+static void keyColIrq(INT32U irqc){
+    PORTC_PCR3 = KEY_COL_PCR|PORT_PCR_IRQC(irqc);
+    PORTC_PCR4 = KEY_COL_PCR|PORT_PCR_IRQC(irqc);
+    PORTC_PCR5 = KEY_COL_PCR|PORT_PCR_IRQC(irqc);
+    PORTC_PCR6 = KEY_COL_PCR|PORT_PCR_IRQC(irqc);
+}
+
+/********************************************************************
+* PORTC_IRQHandler() - Column pin interrupt. Disarms the columns so
+*                      scanning can drive the rows, and wakes
+*                      keyTask().
+* (Private)
+********************************************************************/
+void PORTC_IRQHandler(void){
+
+    OS_ERR os_err;
+    CPU_SR_ALLOC();
+
+    CPU_CRITICAL_ENTER();
+    OSIntEnter();
+    CPU_CRITICAL_EXIT();
+
+    keyColIrq(KEY_IRQC_OFF);
+    PORTC_ISFR = COLS_MASK;
+    (void)OSTaskSemPost(&keyTaskTCB, OS_OPT_POST_NONE, &os_err);
+
+    OSIntExit();
+}
+
+/********************************************************************
+* keyScan() - Scans the keypad and returns every key down.
 *           - Designed for 4x4 keypad with columns pulled high.
-*           - Current keycodes follow:
-*               1->0x01,2->0x02,3->0x03,A->0x04
-*               4->0x05,5->0x06,6->0x07,B->0x08
-*               7->0x09,8->0x0A,9->0x0B,C->0x0C
-*               *->0x0D,0->0x0E,#->0x0F,D->0x10
+*           - Bit n is set for keyCodeTable[n], row by row:
+*               1->bit0, 2->bit1, 3->bit2, A->bit3
+*               4->bit4, 5->bit5, 6->bit6, B->bit7
+*               7->bit8, 8->bit9, 9->bit10, C->bit11
+*               *->bit12, 0->bit13, #->bit14, D->bit15
 *           - Returns zero if no key is pressed.
-*           - ColTable[] can be changed to distinguish multiple keys
-*             pressed in the same row.
+*           - Without diodes, three keys on the corners of a rectangle
+*             also pull the fourth corner. A scan that could be such a
+*             ghost returns the debounced state, so nothing changes
+*             until it clears.
 * (Private)
 ********************************************************************/
-static INT8U keyScan(void) {
+static INT16U keyScan(void) {
 
-    INT8U kcode;
-    INT8U roff;
+    INT16U keys = 0;
+    INT8U row[4];
+    INT8U r;
+    INT8U q;
+    INT8U common;
+    INT8U both;
     INT32U rbit;
 
-    const INT8U ColTable[16] = {0,1,2,2,3,3,3,3,4,4,4,4,4,4,4,4};
-
     rbit = 0x00000080;
-    roff = 0x00;
-    while(rbit != 0){ /* Until all rows are scanned */
+    for(r = 0; r < 4; r++){ /* All rows */
         KEY_PORT_OUT &= ~ROWS_MASK;
         KEY_PORT_DIR = (KEY_PORT_DIR & ~ROWS_MASK)|rbit;    /* Pull row low */
         keyDly();	// wait for direction and col inputs to settle
-        kcode = (INT8U)(((~KEY_PORT_IN) & COLS_MASK)>>3);  /*Read columns */
-        KEY_PORT_DIR = (KEY_PORT_DIR &~ROWS_MASK); 
-        if(kcode != 0){        /* generate key code if key pressed */
-            kcode = roff + ColTable[kcode];
-            break;
-        }
+        row[r] = (INT8U)(((~KEY_PORT_IN) & COLS_MASK)>>3);  /*Read columns */
+        KEY_PORT_DIR = (KEY_PORT_DIR &~ROWS_MASK);
+        keys |= (INT16U)row[r] << (4U * r);
         rbit = ROWS_MASK & (rbit<<1);       /* setup for next row */
-        roff += 4;
     }
-    return (kcode); 
+    for(r = 0; r < 3; r++){ /* Ghost check, every pair of rows */
+        for(q = r + 1U; q < 4; q++){
+            common = row[r] & row[q];
+            both = row[r] | row[q];
+            if((common != 0) && ((both & (both - 1U)) != 0)){
+                keys = keyState;
+            }else{
+            }
+        }
+    }
+    return (keys);
 }
 /********************************************************************
  * keyDly() a software delay for keyScan() to wait until port row
@@ -29,11 +29,37 @@
 #define D_KEY 0x14
 #define NUMBER_KEY_TO_DEC_FACTOR 48 // Taking any of the numbered keys and subtracting this (48) will turn the value into the decimal printed on key
 
+//Key event edges
+#define KEY_RELEASE 0U
+#define KEY_PRESS 1U
+#define KEY_HOLD 2U             /* Still down after KEY_HOLD_TICKS */
+#define KEY_REPEAT 3U           /* Auto-repeat while held */
+#define KEY_CHORD 4U            /* Press leaving two or more keys down */
+
+//Hold and auto-repeat timing, ticks. Resolution is the 4 tick scan period.
+#define KEY_HOLD_TICKS 500U
+#define KEY_RPT_START_TICKS 200U    /* First repeat interval */
+#define KEY_RPT_MIN_TICKS 40U       /* Fastest repeat interval */
+#define KEY_RPT_ACCEL_TICKS 16U     /* Interval cut per repeat */
+
+typedef struct{
+    INT8U code;             /* Key code, as from KeyPend() */
+    INT8U edge;             /* KEY_PRESS, KEY_RELEASE, KEY_HOLD, KEY_REPEAT, KEY_CHORD */
+    INT16U keys;            /* All keys down, as KeyGetState() */
+    OS_TICK ts;             /* OSTimeGet() when debounced */
+}KEY_EVENT;
+
 INT8U KeyPend(INT16U tout, OS_ERR *os_err); /* Pend on key press*/
                              /* tout - semaphore timeout           */
                              /* *err - destination of err code     */
                              /* Error codes are identical to a semaphore */
 
+INT8U KeyPendEvents(KEY_EVENT *events, INT8U max, INT16U tout, OS_ERR *os_err);
+                             /* Pend on key events, batch drain   */
+INT32U KeyGetDrops(void);       /* Events lost to a full ring */
+INT16U KeyGetState(void);       /* Debounced keys down, bitmap */
+INT16U KeyBit(INT8U code);      /* Bitmap bit of a key code */
+
 void KeyInit(void);             /* Keypad Initialization    */
 
 #endif